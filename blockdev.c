@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include "blockdev.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_BUFFER_RECORDS 512U
+
+struct blockdev_ops {
+    const char *name;
+    void (*read)(struct blockdev *dev, uint32_t block_index, void *buf);
+    void (*write)(struct blockdev *dev, uint32_t block_index, const void *buf);
+    int (*flush)(struct blockdev *dev);
+    int (*close)(struct blockdev *dev);
+};
+
+struct blockdev {
+    const struct blockdev_ops *ops;
+    int fd;
+    int direct;
+    uint8_t *base;
+    uint64_t size;
+};
+
+/* One trace per process, shared by every device it opens and by the write-back threads. */
+static struct {
+    int fd;
+    uint8_t tool;
+    uint32_t pid;
+    uint32_t count;
+    pthread_mutex_t lock;
+    struct bdev_trace_record records[TRACE_BUFFER_RECORDS];
+} trace = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static const char *const trace_tool_names[BDEV_TRACE_TOOLS] = {
+    "other", "mkfs", "journal", "validator", "replay",
+};
+
+static void bdev_die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+/* Caller holds trace.lock. A failed write stops tracing rather than failing the tool. */
+static void trace_flush_locked(void) {
+    size_t len = trace.count * sizeof(trace.records[0]);
+    if (trace.fd >= 0 && len > 0 && write(trace.fd, trace.records, len) != (ssize_t)len) {
+        perror("write trace");
+        close(trace.fd);
+        __atomic_store_n(&trace.fd, -1, __ATOMIC_RELAXED);
+    }
+    trace.count = 0;
+}
+
+static void trace_flush(void) {
+    pthread_mutex_lock(&trace.lock);
+    trace_flush_locked();
+    pthread_mutex_unlock(&trace.lock);
+}
+
+static void trace_open(void) {
+    const char *path = getenv("VSFS_BDEV_TRACE");
+    if (!path || *path == '\0' || trace.fd >= 0) {
+        return;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open trace");
+        return;
+    }
+    
+    /* Writers that find the file empty race to add the header; the lock lets exactly one win. */
+    struct stat st;
+    if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+        perror("lock trace");
+        close(fd);
+        return;
+    }
+    if (st.st_size == 0) {
+        struct bdev_trace_header hdr = { BDEV_TRACE_MAGIC, BDEV_TRACE_VERSION };
+        if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+            perror("write trace header");
+            close(fd);
+            return;
+        }
+    }
+    flock(fd, LOCK_UN);
+    
+    trace.tool = BDEV_TRACE_OTHER;
+    for (uint8_t t = 1; t < BDEV_TRACE_TOOLS; ++t) {
+        if (strcmp(program_invocation_short_name, trace_tool_names[t]) == 0) {
+            trace.tool = t;
+            break;
+        }
+    }
+    trace.pid = (uint32_t)getpid();
+    trace.fd = fd;
+    atexit(trace_flush);
+}
+
+static int tracing(void) {
+    return __atomic_load_n(&trace.fd, __ATOMIC_RELAXED) >= 0;
+}
+
+static void trace_record(uint8_t op, uint32_t block_index, uint64_t start) {
+    uint64_t end = trace_now();
+    pthread_mutex_lock(&trace.lock);
+    struct bdev_trace_record *rec = &trace.records[trace.count++];
+    rec->time_ns = start;
+    rec->duration_ns = end - start > UINT32_MAX ? UINT32_MAX : (uint32_t)(end - start);
+    rec->block = block_index;
+    rec->pid = trace.pid;
+    rec->size = BDEV_BLOCK_SIZE;
+    rec->op = op;
+    rec->tool = trace.tool;
+    if (trace.count == TRACE_BUFFER_RECORDS) {
+        trace_flush_locked();
+    }
+    pthread_mutex_unlock(&trace.lock);
+}
+
+static int open_image(const char *path, int flags) {
+    if (flags & BDEV_CREATE) {
+        return open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    }
+    return open(path, (flags & BDEV_RDONLY) ? O_RDONLY : O_RDWR);
+}
+
+static void size_image(struct blockdev *dev, int flags, uint32_t nblocks) {
+    if (flags & BDEV_CREATE) {
+        dev->size = (uint64_t)nblocks * BDEV_BLOCK_SIZE;
+        if (dev->fd >= 0 && ftruncate(dev->fd, (off_t)dev->size) < 0) {
+            bdev_die("ftruncate");
+        }
+        return;
+    }
+    struct stat st;
+    if (fstat(dev->fd, &st) < 0) {
+        bdev_die("fstat");
+    }
+    dev->size = (uint64_t)st.st_size;
+}
+
+/* Faults on any transfer outside the image, like a short pread would. */
+static uint8_t *mapped_block(struct blockdev *dev, uint32_t block_index) {
+    uint64_t offset = (uint64_t)block_index * BDEV_BLOCK_SIZE;
+    if (offset + BDEV_BLOCK_SIZE > dev->size) {
+        errno = EINVAL;
+        bdev_die("block out of range");
+    }
+    return dev->base + offset;
+}
+
+/* file: O_DIRECT transfers from unaligned buffers go through a per-thread bounce block. */
+
+static void file_read(struct blockdev *dev, uint32_t block_index, void *buf) {
+    _Alignas(BDEV_BLOCK_SIZE) static _Thread_local uint8_t bounce[BDEV_BLOCK_SIZE];
+    off_t offset = (off_t)block_index * BDEV_BLOCK_SIZE;
+    void *target = (dev->direct && (uintptr_t)buf % BDEV_BLOCK_SIZE) ? bounce : buf;
+    ssize_t n = pread(dev->fd, target, BDEV_BLOCK_SIZE, offset);
+    if (n != (ssize_t)BDEV_BLOCK_SIZE) {
+        bdev_die("pread");
+    }
+    if (target != buf) {
+        memcpy(buf, bounce, BDEV_BLOCK_SIZE);
+    }
+}
+
+static void file_write(struct blockdev *dev, uint32_t block_index, const void *buf) {
+    _Alignas(BDEV_BLOCK_SIZE) static _Thread_local uint8_t bounce[BDEV_BLOCK_SIZE];
+    off_t offset = (off_t)block_index * BDEV_BLOCK_SIZE;
+    if (dev->direct && (uintptr_t)buf % BDEV_BLOCK_SIZE) {
+        memcpy(bounce, buf, BDEV_BLOCK_SIZE);
+        buf = bounce;
+    }
+    ssize_t n = pwrite(dev->fd, buf, BDEV_BLOCK_SIZE, offset);
+    if (n != (ssize_t)BDEV_BLOCK_SIZE) {
+        bdev_die("pwrite");
+    }
+}
+
+static int file_flush(struct blockdev *dev) {
+    return fdatasync(dev->fd);
+}
+
+static int file_close(struct blockdev *dev) {
+    return close(dev->fd);
+}
+
+/* mmap and memory share the copy paths; only setup and teardown differ. */
+
+static void mapped_read(struct blockdev *dev, uint32_t block_index, void *buf) {
+    memcpy(buf, mapped_block(dev, block_index), BDEV_BLOCK_SIZE);
+}
+
+static void mapped_write(struct blockdev *dev, uint32_t block_index, const void *buf) {
+    memcpy(mapped_block(dev, block_index), buf, BDEV_BLOCK_SIZE);
+}
+
+static int mmap_flush(struct blockdev *dev) {
+    return dev->size > 0 ? msync(dev->base, dev->size, MS_SYNC) : 0;
+}
+
+static int mmap_close(struct blockdev *dev) {
+    int rc = 0;
+    if (dev->size > 0 && munmap(dev->base, dev->size) < 0) {
+        rc = -1;
+    }
+    if (close(dev->fd) < 0) {
+        rc = -1;
+    }
+    return rc;
+}
+
+/* Nothing below the memory image can lose writes it has already taken. */
+static int memory_flush(struct blockdev *dev) {
+    (void)dev;
+    return 0;
+}
+
+static int memory_close(struct blockdev *dev) {
+    const char *snapshot = getenv("VSFS_BDEV_SNAPSHOT");
+    int rc = 0;
+    
+    if (snapshot && *snapshot != '\0') {
+        int out = open(snapshot, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (out < 0) {
+            perror("open snapshot");
+            rc = -1;
+        }
+        else {
+            for (uint64_t done = 0; done < dev->size; ) {
+                ssize_t n = write(out, dev->base + done, dev->size - done);
+                if (n <= 0) {
+                    perror("write snapshot");
+                    rc = -1;
+                    break;
+                }
+                done += (uint64_t)n;
+            }
+            if (close(out) < 0) {
+                rc = -1;
+            }
+        }
+    }
+    free(dev->base);
+    if (dev->fd >= 0 && close(dev->fd) < 0) {
+        rc = -1;
+    }
+    return rc;
+}
+
+static const struct blockdev_ops file_ops = { "file", file_read, file_write, file_flush, file_close };
+static const struct blockdev_ops mmap_ops = { "mmap", mapped_read, mapped_write, mmap_flush, mmap_close };
+static const struct blockdev_ops memory_ops = { "memory", mapped_read, mapped_write, memory_flush, memory_close };
+
+static void open_file(struct blockdev *dev, const char *path, int flags) {
+    if (flags & BDEV_DIRECT) {
+        int direct_flags = ((flags & BDEV_RDONLY) ? O_RDONLY : O_RDWR) | O_DIRECT;
+        dev->fd = open(path, direct_flags | ((flags & BDEV_CREATE) ? O_CREAT | O_TRUNC : 0), 0644);
+        if (dev->fd >= 0) {
+            dev->direct = 1;
+            return;
+        }
+        if (errno != EINVAL) {
+            bdev_die("open");
+        }
+        fprintf(stderr, "O_DIRECT not supported for '%s', using buffered I/O\n", path);
+    }
+    dev->fd = open_image(path, flags);
+    if (dev->fd < 0) {
+        bdev_die("open");
+    }
+}
+
+static void open_mmap(struct blockdev *dev, const char *path, int flags, uint32_t nblocks) {
+    dev->fd = open_image(path, flags);
+    if (dev->fd < 0) {
+        bdev_die("open");
+    }
+    size_image(dev, flags, nblocks);
+    if (dev->size == 0) {
+        return;
+    }
+    int prot = PROT_READ | ((flags & BDEV_RDONLY) ? 0 : PROT_WRITE);
+    void *base = mmap(NULL, dev->size, prot, MAP_SHARED, dev->fd, 0);
+    if (base == MAP_FAILED) {
+        bdev_die("mmap");
+    }
+    dev->base = base;
+}
+
+/* A created memory image never touches path; an existing one is loaded and kept open for locking. */
+static void open_memory(struct blockdev *dev, const char *path, int flags, uint32_t nblocks) {
+    dev->fd = -1;
+    if (flags & BDEV_CREATE) {
+        size_image(dev, flags, nblocks);
+    }
+    else {
+        dev->fd = open_image(path, flags);
+        if (dev->fd < 0) {
+            bdev_die("open");
+        }
+        size_image(dev, flags, nblocks);
+    }
+    
+    void *base;
+    if (posix_memalign(&base, BDEV_BLOCK_SIZE, dev->size ? dev->size : BDEV_BLOCK_SIZE) != 0) {
+        errno = ENOMEM;
+        bdev_die("posix_memalign");
+    }
+    dev->base = base;
+    memset(dev->base, 0, dev->size);
+    
+    for (uint64_t done = 0; dev->fd >= 0 && done < dev->size; ) {
+        ssize_t n = pread(dev->fd, dev->base + done, dev->size - done, (off_t)done);
+        if (n <= 0) {
+            bdev_die("pread image");
+        }
+        done += (uint64_t)n;
+    }
+}
+
+struct blockdev *bdev_open(const char *path, int flags, uint32_t nblocks) {
+    const char *backend = getenv("VSFS_BDEV");
+    struct blockdev *dev = calloc(1, sizeof(*dev));
+    if (!dev) {
+        bdev_die("malloc blockdev");
+    }
+    trace_open();
+    
+    if (!backend || *backend == '\0' || strcmp(backend, "file") == 0) {
+        dev->ops = &file_ops;
+        open_file(dev, path, flags);
+        if (flags & BDEV_CREATE) {
+            size_image(dev, flags, nblocks);
+        }
+    }
+    else if (strcmp(backend, "mmap") == 0) {
+        dev->ops = &mmap_ops;
+        open_mmap(dev, path, flags, nblocks);
+    }
+    else if (strcmp(backend, "memory") == 0) {
+        dev->ops = &memory_ops;
+        open_memory(dev, path, flags, nblocks);
+    }
+    else {
+        fprintf(stderr, "Unknown VSFS_BDEV backend '%s' (expected file, mmap or memory)\n", backend);
+        exit(EXIT_FAILURE);
+    }
+    return dev;
+}
+
+void bdev_read(struct blockdev *dev, uint32_t block_index, void *buf) {
+    if (!tracing()) {
+        dev->ops->read(dev, block_index, buf);
+        return;
+    }
+    uint64_t start = trace_now();
+    dev->ops->read(dev, block_index, buf);
+    trace_record(BDEV_TRACE_READ, block_index, start);
+}
+
+void bdev_write(struct blockdev *dev, uint32_t block_index, const void *buf) {
+    if (!tracing()) {
+        dev->ops->write(dev, block_index, buf);
+        return;
+    }
+    uint64_t start = trace_now();
+    dev->ops->write(dev, block_index, buf);
+    trace_record(BDEV_TRACE_WRITE, block_index, start);
+}
+
+void bdev_flush(struct blockdev *dev) {
+    if (dev->ops->flush(dev) < 0) {
+        bdev_die("flush");
+    }
+}
+
+int bdev_fd(const struct blockdev *dev) {
+    return dev->fd;
+}
+
+int bdev_direct(const struct blockdev *dev) {
+    return dev->direct;
+}
+
+const char *bdev_backend(const struct blockdev *dev) {
+    return dev->ops->name;
+}
+
+const char *bdev_trace_tool_name(uint8_t tool) {
+    return tool < BDEV_TRACE_TOOLS ? trace_tool_names[tool] : trace_tool_names[BDEV_TRACE_OTHER];
+}
+
+int bdev_close(struct blockdev *dev) {
+    trace_flush();
+    int rc = dev->ops->close(dev);
+    free(dev);
+    return rc;
+}
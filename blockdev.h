@@ -0,0 +1,96 @@
+#ifndef VSFS_BLOCKDEV_H
+#define VSFS_BLOCKDEV_H
+
+#include <stdint.h>
+
+/*
+ * Block access to a VSFS image, shared by the tools. The backend is chosen
+ * at open time from VSFS_BDEV:
+ *
+ *   file    pread/pwrite on the image (default)
+ *   mmap    a shared mapping of the image
+ *   memory  a private in-RAM copy loaded at open; writes never reach the
+ *           image, and VSFS_BDEV_SNAPSHOT names a file the final contents
+ *           are saved to at close
+ *
+ * Every transfer is one BDEV_BLOCK_SIZE block, and I/O errors are fatal,
+ * as they always were for the tools.
+ *
+ * With VSFS_BDEV_TRACE set, every transfer on any backend is also appended
+ * to that file as a bdev_trace_record. The file starts with a
+ * bdev_trace_header, and several processes may append to the same trace.
+ */
+
+#define BDEV_BLOCK_SIZE 4096U
+
+#define BDEV_RDONLY 0x1
+#define BDEV_CREATE 0x2
+#define BDEV_DIRECT 0x4
+
+#define BDEV_TRACE_MAGIC 0x56545243U
+#define BDEV_TRACE_VERSION 1U
+
+enum bdev_trace_op {
+    BDEV_TRACE_READ = 1,
+    BDEV_TRACE_WRITE = 2,
+};
+
+/* Tools are identified by program name; anything else is BDEV_TRACE_OTHER. */
+enum bdev_trace_tool {
+    BDEV_TRACE_OTHER = 0,
+    BDEV_TRACE_MKFS = 1,
+    BDEV_TRACE_JOURNAL = 2,
+    BDEV_TRACE_VALIDATOR = 3,
+    BDEV_TRACE_REPLAY = 4,
+    BDEV_TRACE_TOOLS,
+};
+
+struct bdev_trace_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+/* time_ns is CLOCK_MONOTONIC when the transfer was issued, so records from different processes interleave correctly. */
+struct bdev_trace_record {
+    uint64_t time_ns;
+    uint32_t duration_ns;
+    uint32_t block;
+    uint32_t pid;
+    uint16_t size;
+    uint8_t op;
+    uint8_t tool;
+};
+
+_Static_assert(sizeof(struct bdev_trace_header) == 8, "bdev_trace_header must be 8 bytes");
+_Static_assert(sizeof(struct bdev_trace_record) == 24, "bdev_trace_record must be 24 bytes");
+
+struct blockdev;
+
+/* BDEV_CREATE truncates the image to nblocks zero blocks; BDEV_DIRECT asks the file backend for O_DIRECT. */
+struct blockdev *bdev_open(const char *path, int flags, uint32_t nblocks);
+
+void bdev_read(struct blockdev *dev, uint32_t block_index, void *buf);
+
+void bdev_write(struct blockdev *dev, uint32_t block_index, const void *buf);
+
+/* Waits until every write issued so far is on stable storage. */
+void bdev_flush(struct blockdev *dev);
+
+/* Descriptor of the image file for fcntl locking, or -1 for a memory image created from scratch. */
+int bdev_fd(const struct blockdev *dev);
+
+/* Nonzero when the file backend ended up with O_DIRECT. */
+int bdev_direct(const struct blockdev *dev);
+
+const char *bdev_backend(const struct blockdev *dev);
+
+/* Name of a bdev_trace_tool, or "other" for unknown values. */
+const char *bdev_trace_tool_name(uint8_t tool);
+
+/*
+ * Saves any memory snapshot, closes the image and frees dev; returns -1 on failure.
+ * It does not flush: call bdev_flush first if earlier writes must be durable.
+ */
+int bdev_close(struct blockdev *dev);
+
+#endif
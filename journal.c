@@ -1,6 +1,7 @@
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,23 +9,65 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "blockdev.h"
+#include "latency.h"
+#include "probes.h"
+
 #define FS_MAGIC 0x56534653U
 #define BLOCK_SIZE        4096U
 #define INODE_SIZE         128U
 #define JOURNAL_BLOCK_IDX    1U
 #define JOURNAL_BLOCKS      16U
-#define INODE_BLOCKS         2U
-#define DATA_BLOCKS         64U
-#define INODE_BMAP_IDX     (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
-#define DATA_BMAP_IDX      (INODE_BMAP_IDX + 1U)
-#define INODE_START_IDX    (DATA_BMAP_IDX + 1U)
-#define DATA_START_IDX     (INODE_START_IDX + INODE_BLOCKS)
-#define TOTAL_BLOCKS       (DATA_START_IDX + DATA_BLOCKS)
+#define GROUP_COUNT          2U
+#define GROUP_INODE_BLOCKS   1U
+#define GROUP_DATA_BLOCKS   32U
+#define GROUP_BLOCKS       (2U + GROUP_INODE_BLOCKS + GROUP_DATA_BLOCKS)
+#define GROUP_START_IDX    (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
+#define GROUP_INODE_BMAP(g)  (GROUP_START_IDX + (g) * GROUP_BLOCKS)
+#define GROUP_DATA_BMAP(g)   (GROUP_INODE_BMAP(g) + 1U)
+#define GROUP_INODE_START(g) (GROUP_INODE_BMAP(g) + 2U)
+#define GROUP_DATA_START(g)  (GROUP_INODE_START(g) + GROUP_INODE_BLOCKS)
+#define INODE_BLOCKS       (GROUP_COUNT * GROUP_INODE_BLOCKS)
+#define DATA_BLOCKS        (GROUP_COUNT * GROUP_DATA_BLOCKS)
+#define INODE_BMAP_IDX     GROUP_INODE_BMAP(0U)
+#define DATA_BMAP_IDX      GROUP_DATA_BMAP(0U)
+#define INODE_START_IDX    GROUP_INODE_START(0U)
+#define DATA_START_IDX     GROUP_DATA_START(0U)
+#define TOTAL_BLOCKS       (GROUP_START_IDX + GROUP_COUNT * GROUP_BLOCKS)
+#define INODES_PER_BLOCK   (BLOCK_SIZE / INODE_SIZE)
+#define INODES_PER_GROUP   (GROUP_INODE_BLOCKS * INODES_PER_BLOCK)
+#define GROUP_INODE_UNINIT 0x1U
+#define INODE_INLINE       0x1U
+#define DIRECT_POINTERS     8U
+#define INLINE_DATA_MAX    (INODE_SIZE - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4 + 4))
+#define FILE_MAX_BYTES     (DIRECT_POINTERS * BLOCK_SIZE)
 #define DEFAULT_IMAGE "vsfs.img"
 
 #define JOURNAL_MAGIC 0x4A524E4CU
 #define REC_DATA      1
 #define REC_COMMIT    2
+#define REC_REVOKE    3
+#define REC_ZDATA     4
+#define REC_DESC      5
+#define REC_CREATE    6
+#define REC_PAD       7   /* bare rec_header whose size skips dead bytes */
+
+#define ZCODEC_ZERORUN 1
+#define ZCODEC_LZ      2
+#define COMPRESS_DEFAULT_LEVEL 2U
+#define LZ_HASH_BITS  12U
+#define LZ_MIN_MATCH   4U
+
+#define CACHE_BUCKETS       64U
+#define CACHE_DEFAULT_BLOCKS 32U
+#define TXN_MAX_BLOCKS      16U
+#define WRITEBACK_DEFAULT_THREADS 4U
+#define WRITEBACK_MAX_THREADS    64U
+
+#define CKPT_DEFAULT_FILL_PCT 75U
+#define CKPT_DEFAULT_MAX_AGE   0U
+#define CKPT_DEFAULT_MAX_TXNS  0U
+#define CKPT_DEFAULT_PROGRESS  4U
 
 struct superblock {
     uint32_t magic;
@@ -36,17 +79,20 @@ struct superblock {
     uint32_t data_bitmap;
     uint32_t inode_start;
     uint32_t data_start;
-    uint8_t  _pad[128 - 9 * 4];
+    uint32_t group_count;
+    uint32_t group_blocks;
+    uint8_t  _pad[128 - 11 * 4];
 };
 
 struct inode {
     uint16_t type;
     uint16_t links;
     uint32_t size;
-    uint32_t direct[8];
+    uint32_t direct[DIRECT_POINTERS];
     uint32_t ctime;
     uint32_t mtime;
-    uint8_t _pad[128 - (2 + 2 + 4 + 8 * 4 + 4 + 4)];
+    uint32_t flags;
+    uint8_t inline_data[INLINE_DATA_MAX];
 };
 
 struct dirent {
@@ -54,9 +100,20 @@ struct dirent {
     char name[28];
 };
 
+/* Trailer at the end of every group bitmap block. */
+struct group_summary {
+    uint32_t free_count;
+    uint32_t flags;
+};
+
+#define SUMMARY_OFFSET (BLOCK_SIZE - sizeof(struct group_summary))
+
+/* Transactions with tid <= checkpoint_tid are already written back and are skipped. */
 struct journal_header {
     uint32_t magic;
     uint32_t nbytes_used;
+    uint32_t last_tid;
+    uint32_t checkpoint_tid;
 };
 
 struct rec_header {
@@ -70,90 +127,811 @@ struct data_record {
     uint8_t data[BLOCK_SIZE];
 };
 
+/*
+ * Followed by the encoded block and then tail zero bytes, which round the
+ * record up to 4 bytes so the records after it stay aligned.
+ */
+struct zdata_record {
+    struct rec_header hdr;
+    uint32_t block_no;
+    uint8_t codec;
+    uint8_t tail;
+    uint8_t _pad[2];
+};
+
+#define ZDATA_RECORD_SIZE(len) ((sizeof(struct zdata_record) + (len) + 3U) & ~3U)
+
+/*
+ * Aligned layout: followed by count block numbers, padded so the record ends
+ * on a journal block boundary, then count whole payload blocks in order.
+ */
+struct desc_record {
+    struct rec_header hdr;
+    uint32_t count;
+};
+
+/* Followed by count block numbers whose earlier journal copies must not be replayed. */
+struct revoke_record {
+    struct rec_header hdr;
+    uint32_t count;
+};
+
 struct commit_record {
     struct rec_header hdr;
+    uint32_t commit_time;
+    uint32_t tid;
+};
+
+/*
+ * Logical create: allocate inode ino, initialize it with ctime = mtime = time,
+ * and link it as name at root directory slot. Replay redoes it on the current
+ * blocks instead of copying logged images.
+ */
+struct create_record {
+    struct rec_header hdr;
+    uint32_t ino;
+    uint16_t slot;
+    uint16_t _pad;
+    uint32_t time;
+    char name[28];
 };
 
 _Static_assert(sizeof(struct superblock) == 128, "superblock must be 128 bytes");
 _Static_assert(sizeof(struct inode) == 128, "inode must be 128 bytes");
 _Static_assert(sizeof(struct dirent) == 32, "dirent must be 32 bytes");
-_Static_assert(sizeof(struct journal_header) == 8, "journal_header must be 8 bytes");
+_Static_assert(sizeof(struct journal_header) == 16, "journal_header must be 16 bytes");
 _Static_assert(sizeof(struct rec_header) == 4, "rec_header must be 4 bytes");
+_Static_assert(sizeof(struct commit_record) == 12, "commit_record must be 12 bytes");
+_Static_assert(sizeof(struct zdata_record) == 12, "zdata_record must be 12 bytes");
+_Static_assert(sizeof(struct create_record) == 44, "create_record must be 44 bytes");
+_Static_assert(INODES_PER_GROUP <= SUMMARY_OFFSET * 8, "inode bitmap overlaps its summary");
+_Static_assert(GROUP_DATA_BLOCKS <= SUMMARY_OFFSET * 8, "data bitmap overlaps its summary");
 
 static void die(const char *msg) {
     perror(msg);
     exit(EXIT_FAILURE);
 }
 
-static void pread_block(int fd, uint32_t block_index, void *buf) {
-    off_t offset = (off_t)block_index * BLOCK_SIZE;
-    ssize_t n = pread(fd, buf, BLOCK_SIZE, offset);
-    if (n != (ssize_t)BLOCK_SIZE) {
-        die("pread");
+/* Zeroed, block-aligned allocation so buffers can go straight to an O_DIRECT fd. */
+static void *alloc_blocks(size_t size) {
+    void *buf;
+    if (posix_memalign(&buf, BLOCK_SIZE, size) != 0) {
+        errno = ENOMEM;
+        die("posix_memalign");
+    }
+    memset(buf, 0, size);
+    return buf;
+}
+
+/*
+ * Byte-range locks over the image, always taken in this order: directory
+ * blocks, then each group's inode bitmap and inode table, then data bitmaps,
+ * then the journal region. A checkpoint takes the whole image in one request.
+ */
+static void lock_range(int fd, uint32_t first_block, uint32_t nblocks, short type) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = (off_t)first_block * BLOCK_SIZE;
+    fl.l_len = (off_t)nblocks * BLOCK_SIZE;
+    while (fcntl(fd, F_SETLKW, &fl) < 0) {
+        if (errno != EINTR) {
+            die("fcntl lock");
+        }
+    }
+}
+
+static void lock_block(int fd, uint32_t block_index, short type) {
+    lock_range(fd, block_index, 1, type);
+}
+
+/*
+ * Takes every group, not just the one an allocation lands in: creates already
+ * serialize on the root directory block, and a writer holding only part of the
+ * image could deadlock with another when a checkpoint takes the whole of it.
+ */
+static void lock_inode_groups(int fd, short type) {
+    for (uint32_t g = 0; g < GROUP_COUNT; ++g) {
+        lock_block(fd, GROUP_INODE_BMAP(g), type);
+        lock_range(fd, GROUP_INODE_START(g), GROUP_INODE_BLOCKS, type);
     }
 }
 
-static void pwrite_block(int fd, uint32_t block_index, const void *buf) {
-    off_t offset = (off_t)block_index * BLOCK_SIZE;
-    ssize_t n = pwrite(fd, buf, BLOCK_SIZE, offset);
-    if (n != (ssize_t)BLOCK_SIZE) {
-        die("pwrite");
+static void lock_data_bitmaps(int fd, short type) {
+    for (uint32_t g = 0; g < GROUP_COUNT; ++g) {
+        lock_block(fd, GROUP_DATA_BMAP(g), type);
     }
 }
 
+static void lock_journal(int fd, short type) {
+    lock_range(fd, JOURNAL_BLOCK_IDX, JOURNAL_BLOCKS, type);
+}
+
+static void lock_image(int fd, short type) {
+    lock_range(fd, 0, 0, type);
+}
+
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "bitmap words assume little-endian byte order");
+
+static uint32_t inode_alloc_hint;
+static uint32_t data_alloc_hint;
+
 static int bitmap_test(const uint8_t *bitmap, uint32_t index) {
     return (bitmap[index / 8] >> (index % 8)) & 0x1;
 }
 
-static void bitmap_set(uint8_t *bitmap, uint32_t index) {
-    bitmap[index / 8] |= (uint8_t)(1U << (index % 8));
+static uint64_t bitmap_word_mask(uint32_t word, uint32_t first, uint32_t end) {
+    uint32_t lo = (word == first / 64) ? first % 64 : 0;
+    uint32_t hi = (word == (end - 1) / 64) ? (end - 1) % 64 : 63;
+    return (~0ULL << lo) & (~0ULL >> (63 - hi));
 }
 
-static int find_free_bit(const uint8_t *bitmap, uint32_t max_bits) {
-    for (uint32_t i = 0; i < max_bits; ++i) {
-        if (!bitmap_test(bitmap, i)) {
-            return (int)i;
+/*
+ * Claims a clear bit in [first, end), scanning 64-bit words from the word of
+ * the last claimed bit in hint so successive claims skip the full words.
+ */
+static int bitmap_claim(uint64_t *words, uint32_t first, uint32_t end, uint32_t *hint) {
+    if (first >= end) {
+        return -1;
+    }
+    uint32_t first_word = first / 64;
+    uint32_t nwords = (end - 1) / 64 - first_word + 1;
+    uint32_t start = (*hint >= first && *hint < end) ? *hint / 64 - first_word : 0;
+    
+    for (uint32_t n = 0; n < nwords; ++n) {
+        uint32_t w = first_word + (start + n) % nwords;
+        uint64_t mask = bitmap_word_mask(w, first, end);
+        uint64_t avail = ~words[w] & mask;
+        if (avail) {
+            uint32_t bit = (uint32_t)__builtin_ctzll(avail);
+            words[w] |= 1ULL << bit;
+            *hint = w * 64 + bit;
+            return (int)*hint;
+        }
+    }
+    return -1;
+}
+
+/* data comes first so that aligned entries hold aligned blocks. */
+struct cache_entry {
+    uint8_t data[BLOCK_SIZE];
+    uint32_t block_no;
+    int dirty;
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+};
+
+/* Write-back LRU cache of home-location blocks; dirty means newer than disk. */
+struct block_cache {
+    struct blockdev *dev;
+    int fd;
+    uint32_t capacity;
+    uint32_t count;
+    struct cache_entry *buckets[CACHE_BUCKETS];
+    struct cache_entry *lru_head;
+    struct cache_entry *lru_tail;
+};
+
+static void cache_init(struct block_cache *cache, struct blockdev *dev, uint32_t capacity) {
+    memset(cache, 0, sizeof(*cache));
+    cache->dev = dev;
+    cache->fd = bdev_fd(dev);
+    cache->capacity = capacity > 0 ? capacity : 1;
+}
+
+static struct cache_entry **cache_bucket(struct block_cache *cache, uint32_t block_no) {
+    return &cache->buckets[(block_no * 2654435761U) % CACHE_BUCKETS];
+}
+
+static void cache_lru_unlink(struct block_cache *cache, struct cache_entry *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void cache_lru_push(struct block_cache *cache, struct cache_entry *entry) {
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = entry;
+    }
+    cache->lru_head = entry;
+    if (!cache->lru_tail) {
+        cache->lru_tail = entry;
+    }
+}
+
+static void cache_remove(struct block_cache *cache, struct cache_entry *victim) {
+    cache_lru_unlink(cache, victim);
+    struct cache_entry **link = cache_bucket(cache, victim->block_no);
+    while (*link != victim) {
+        link = &(*link)->hash_next;
+    }
+    *link = victim->hash_next;
+    cache->count--;
+    free(victim);
+}
+
+/*
+ * Drops the least recently used clean entry. Dirty entries hold committed
+ * journal state that only a checkpoint may write home, so they stay pinned
+ * and the cache grows past its capacity when nothing clean is left.
+ */
+static int cache_evict(struct block_cache *cache) {
+    for (struct cache_entry *victim = cache->lru_tail; victim; victim = victim->lru_prev) {
+        if (!victim->dirty) {
+            cache_remove(cache, victim);
+            return 0;
         }
     }
     return -1;
 }
 
-static void init_journal(int fd) {
-    uint8_t journal_data[JOURNAL_BLOCKS * BLOCK_SIZE];
+/* Drops block_no without writing it back, e.g. once its journaled copy is revoked. */
+static void cache_discard(struct block_cache *cache, uint32_t block_no) {
+    for (struct cache_entry *entry = *cache_bucket(cache, block_no); entry; entry = entry->hash_next) {
+        if (entry->block_no == block_no) {
+            cache_remove(cache, entry);
+            return;
+        }
+    }
+}
+
+/* Returns the entry for block_no, reading it from disk unless fill is 0. */
+static struct cache_entry *cache_get(struct block_cache *cache, uint32_t block_no, int fill) {
+    struct cache_entry **bucket = cache_bucket(cache, block_no);
+    for (struct cache_entry *entry = *bucket; entry; entry = entry->hash_next) {
+        if (entry->block_no == block_no) {
+            cache_lru_unlink(cache, entry);
+            cache_lru_push(cache, entry);
+            return entry;
+        }
+    }
+    
+    while (cache->count >= cache->capacity && cache_evict(cache) == 0) {
+    }
+    
+    struct cache_entry *entry = alloc_blocks(sizeof(*entry));
+    entry->block_no = block_no;
+    if (fill) {
+        bdev_read(cache->dev, block_no, entry->data);
+    }
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    cache_lru_push(cache, entry);
+    cache->count++;
+    return entry;
+}
+
+static void cache_read_block(struct block_cache *cache, uint32_t block_no, void *buf) {
+    memcpy(buf, cache_get(cache, block_no, 1)->data, BLOCK_SIZE);
+}
+
+static void cache_write_block(struct block_cache *cache, uint32_t block_no, const void *buf) {
+    struct cache_entry *entry = cache_get(cache, block_no, 0);
+    memcpy(entry->data, buf, BLOCK_SIZE);
+    entry->dirty = 1;
+}
+
+/*
+ * Checkpoint write-back workers. Each batch holds at most one entry per
+ * block and pool_write waits for the whole batch, so a block's writes land
+ * in the order the batches are issued.
+ */
+struct writeback_pool {
+    struct blockdev *dev;
+    pthread_t threads[WRITEBACK_MAX_THREADS];
+    uint32_t nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    struct cache_entry **queue;
+    uint32_t queued;
+    uint32_t next;
+    uint32_t pending;
+    int stop;
+};
+
+static uint32_t writeback_threads = WRITEBACK_DEFAULT_THREADS;
+
+static void *writeback_worker(void *arg) {
+    struct writeback_pool *pool = arg;
+    
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->next == pool->queued) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->next == pool->queued) {
+            break;
+        }
+        struct cache_entry *entry = pool->queue[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+        VSFS_PROBE1(block__write, entry->block_no);
+        bdev_write(pool->dev, entry->block_no, entry->data);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* With fewer than two threads, pool_write writes synchronously. */
+static void pool_start(struct writeback_pool *pool, struct blockdev *dev, uint32_t nthreads) {
+    memset(pool, 0, sizeof(*pool));
+    pool->dev = dev;
+    if (nthreads < 2) {
+        return;
+    }
+    if (nthreads > WRITEBACK_MAX_THREADS) {
+        nthreads = WRITEBACK_MAX_THREADS;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    for (; pool->nthreads < nthreads; ++pool->nthreads) {
+        int err = pthread_create(&pool->threads[pool->nthreads], NULL, writeback_worker, pool);
+        if (err != 0) {
+            errno = err;
+            die("pthread_create");
+        }
+    }
+}
+
+static void pool_write(struct writeback_pool *pool, struct cache_entry **entries, uint32_t count) {
+    if (pool->nthreads == 0) {
+        for (uint32_t i = 0; i < count; ++i) {
+            VSFS_PROBE1(block__write, entries[i]->block_no);
+            bdev_write(pool->dev, entries[i]->block_no, entries[i]->data);
+        }
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->queue = entries;
+    pool->queued = count;
+    pool->next = 0;
+    pool->pending = count;
+    pthread_cond_broadcast(&pool->work);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pool->queue = NULL;
+    pool->queued = 0;
+    pool->next = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_stop(struct writeback_pool *pool) {
+    if (pool->nthreads == 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (uint32_t i = 0; i < pool->nthreads; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/* Returns block_no's entry, marked clean, if it is cached and dirty; the caller must write it. */
+static struct cache_entry *cache_take_dirty(struct block_cache *cache, uint32_t block_no) {
+    for (struct cache_entry *entry = *cache_bucket(cache, block_no); entry; entry = entry->hash_next) {
+        if (entry->block_no == block_no && entry->dirty) {
+            entry->dirty = 0;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void cache_flush(struct block_cache *cache, struct writeback_pool *pool) {
+    struct cache_entry **batch = malloc((cache->count + 1) * sizeof(*batch));
+    uint32_t count = 0;
+    
+    if (!batch) {
+        die("malloc flush batch");
+    }
+    for (struct cache_entry *entry = cache->lru_head; entry; entry = entry->lru_next) {
+        if (entry->dirty) {
+            entry->dirty = 0;
+            batch[count++] = entry;
+        }
+    }
+    pool_write(pool, batch, count);
+    free(batch);
+}
+
+static void cache_destroy(struct block_cache *cache) {
+    struct cache_entry *entry = cache->lru_head;
+    while (entry) {
+        struct cache_entry *next = entry->lru_next;
+        free(entry);
+        entry = next;
+    }
+    memset(cache->buckets, 0, sizeof(cache->buckets));
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->count = 0;
+}
+
+/* Parses a plain decimal uint32; rejects signs, spaces, trailing text and overflow. */
+static int parse_u32(const char *value, uint32_t *out) {
+    if (*value < '0' || *value > '9') {
+        return -1;
+    }
+    char *end;
+    errno = 0;
+    unsigned long parsed = strtoul(value, &end, 10);
+    if (*end != '\0' || errno == ERANGE || parsed > UINT32_MAX) {
+        return -1;
+    }
+    *out = (uint32_t)parsed;
+    return 0;
+}
+
+static uint32_t env_u32(const char *name, uint32_t fallback) {
+    const char *value = getenv(name);
+    if (!value || *value == '\0') {
+        return fallback;
+    }
+    uint32_t parsed;
+    if (parse_u32(value, &parsed) < 0) {
+        fprintf(stderr, "Ignoring invalid %s='%s'\n", name, value);
+        return fallback;
+    }
+    return parsed;
+}
+
+static struct group_summary *bitmap_summary(void *bitmap_block) {
+    return (struct group_summary *)((uint8_t *)bitmap_block + SUMMARY_OFFSET);
+}
+
+static uint32_t inode_block_no(uint32_t ino) {
+    return GROUP_INODE_START(ino / INODES_PER_GROUP) + (ino % INODES_PER_GROUP) / INODES_PER_BLOCK;
+}
+
+static uint32_t dir_size(const struct dirent *dirents) {
+    uint32_t max_entries = BLOCK_SIZE / sizeof(struct dirent);
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < max_entries; ++i) {
+        if (dirents[i].inode != 0 || dirents[i].name[0] != '\0') {
+            used = i + 1;
+        }
+    }
+    return used * sizeof(struct dirent);
+}
+
+static uint8_t* read_journal(struct blockdev *dev) {
+    uint8_t *journal_data = alloc_blocks(JOURNAL_BLOCKS * BLOCK_SIZE);
+    
+    bdev_read(dev, JOURNAL_BLOCK_IDX, journal_data);
+    
+    struct journal_header *jhdr = (struct journal_header *)journal_data;
+    if (jhdr->magic != JOURNAL_MAGIC) {
+        return journal_data;
+    }
+    /* Every walk of the records stops at nbytes_used, so it must lie inside the buffer. */
+    if (jhdr->nbytes_used < sizeof(*jhdr) || jhdr->nbytes_used > JOURNAL_BLOCKS * BLOCK_SIZE) {
+        fprintf(stderr, "Corrupt journal header: %u bytes used of %u.\n", jhdr->nbytes_used, JOURNAL_BLOCKS * BLOCK_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    if (jhdr->nbytes_used <= BLOCK_SIZE) {
+        return journal_data;
+    }
     
-    for (uint32_t i = 0; i < JOURNAL_BLOCKS; ++i) {
-        pread_block(fd, JOURNAL_BLOCK_IDX + i, journal_data + (i * BLOCK_SIZE));
+    uint32_t nblocks = (jhdr->nbytes_used + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (uint32_t i = 1; i < nblocks; ++i) {
+        bdev_read(dev, JOURNAL_BLOCK_IDX + i, journal_data + i * BLOCK_SIZE);
     }
     
+    return journal_data;
+}
+
+static void init_journal(struct blockdev *dev, uint8_t *journal_data) {
     struct journal_header *jhdr = (struct journal_header *)journal_data;
     
     if (jhdr->magic == JOURNAL_MAGIC) {
         return;
     }
     
+    memset(journal_data, 0, JOURNAL_BLOCKS * BLOCK_SIZE);
     jhdr->magic = JOURNAL_MAGIC;
     jhdr->nbytes_used = sizeof(struct journal_header);
     
-    pwrite_block(fd, JOURNAL_BLOCK_IDX, journal_data);
+    bdev_write(dev, JOURNAL_BLOCK_IDX, journal_data);
 }
 
-static uint8_t* read_journal(int fd) {
-    uint8_t *journal_data = malloc(JOURNAL_BLOCKS * BLOCK_SIZE);
-    if (!journal_data) {
-        die("malloc journal");
+/* Writes the blocks holding bytes [dirty_from, nbytes_used), header block last. */
+static void write_journal(struct blockdev *dev, const uint8_t *journal_data, uint32_t dirty_from) {
+    const struct journal_header *jhdr = (const struct journal_header *)journal_data;
+    uint32_t first = dirty_from / BLOCK_SIZE;
+    uint32_t end = (jhdr->nbytes_used + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    
+    if (first == 0) {
+        first = 1;
+    }
+    for (uint32_t i = first; i < end && i < JOURNAL_BLOCKS; ++i) {
+        bdev_write(dev, JOURNAL_BLOCK_IDX + i, journal_data + (i * BLOCK_SIZE));
     }
+    bdev_write(dev, JOURNAL_BLOCK_IDX, journal_data);
+}
+
+/* 0 logs raw blocks, 1 elides zero runs, 2 also tries the LZ codec. */
+static uint32_t compress_level = COMPRESS_DEFAULT_LEVEL;
+
+/* Log each transaction's blocks as one descriptor plus block-aligned payloads. */
+static uint32_t journal_aligned;
+
+/* Leave the root inode's size and mtime to replay unless the transaction logs its block anyway. */
+static uint32_t lazytime;
+
+/* Log creates as REC_CREATE operations instead of block images. */
+static uint32_t journal_logical;
+
+/* Log file data blocks in the transaction instead of writing them in place before it commits. */
+static uint32_t data_journal;
+
+/* Journal bytes appended by this process, for the write benchmark. */
+static uint64_t journal_bytes_logged;
+
+/*
+ * Zero-run encoding: a sequence of (uint16 zeros, uint16 literal length,
+ * literal bytes) ops. Bytes past the last op are zero, so an all-zero block
+ * encodes to nothing. Returns -1 if the encoding exceeds cap.
+ */
+static int zerorun_encode(const uint8_t *block, uint8_t *out, uint32_t cap) {
+    uint32_t pos = 0;
+    uint32_t len = 0;
     
-    for (uint32_t i = 0; i < JOURNAL_BLOCKS; ++i) {
-        pread_block(fd, JOURNAL_BLOCK_IDX + i, journal_data + (i * BLOCK_SIZE));
+    while (pos < BLOCK_SIZE) {
+        uint32_t zeros = 0;
+        while (pos + zeros < BLOCK_SIZE && block[pos + zeros] == 0) {
+            zeros++;
+        }
+        pos += zeros;
+        if (pos == BLOCK_SIZE) {
+            break;
+        }
+        
+        /* A literal ends at a zero run long enough to pay for the next op header. */
+        uint32_t lit = 0;
+        uint32_t run = 0;
+        while (pos + lit + run < BLOCK_SIZE && run < 2 * sizeof(uint32_t)) {
+            if (block[pos + lit + run] == 0) {
+                run++;
+            }
+            else {
+                lit += run + 1;
+                run = 0;
+            }
+        }
+        
+        if (len + sizeof(uint32_t) + lit > cap) {
+            return -1;
+        }
+        uint16_t op[2] = { (uint16_t)zeros, (uint16_t)lit };
+        memcpy(out + len, op, sizeof(op));
+        memcpy(out + len + sizeof(op), block + pos, lit);
+        len += sizeof(op) + lit;
+        pos += lit;
     }
+    return (int)len;
+}
+
+static int zerorun_decode(const uint8_t *in, uint32_t len, uint8_t *block) {
+    uint32_t pos = 0;
     
-    return journal_data;
+    memset(block, 0, BLOCK_SIZE);
+    for (uint32_t i = 0; i < len; ) {
+        uint16_t op[2];
+        if (i + sizeof(op) > len) {
+            return -1;
+        }
+        memcpy(op, in + i, sizeof(op));
+        i += sizeof(op);
+        if (pos + op[0] + op[1] > BLOCK_SIZE || i + op[1] > len) {
+            return -1;
+        }
+        pos += op[0];
+        memcpy(block + pos, in + i, op[1]);
+        pos += op[1];
+        i += op[1];
+    }
+    return 0;
+}
+
+static uint32_t lz_load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint32_t lz_put_length(uint8_t *out, uint32_t len, uint32_t cap, uint32_t value) {
+    while (value >= 255) {
+        if (len >= cap) {
+            return 0;
+        }
+        out[len++] = 255;
+        value -= 255;
+    }
+    if (len >= cap) {
+        return 0;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
+
+/* Emits one LZ4-style sequence; a match_len of 0 marks the final literal run. */
+static uint32_t lz_put_sequence(uint8_t *out, uint32_t len, uint32_t cap, const uint8_t *lit, uint32_t lit_len, uint32_t offset, uint32_t match_len) {
+    uint32_t match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+    
+    if (len >= cap) {
+        return 0;
+    }
+    out[len++] = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4 | (match_code < 15 ? match_code : 15));
+    if (lit_len >= 15 && !(len = lz_put_length(out, len, cap, lit_len - 15))) {
+        return 0;
+    }
+    if (len + lit_len > cap) {
+        return 0;
+    }
+    memcpy(out + len, lit, lit_len);
+    len += lit_len;
+    if (match_len == 0) {
+        return len;
+    }
+    
+    if (len + 2 > cap) {
+        return 0;
+    }
+    out[len++] = (uint8_t)offset;
+    out[len++] = (uint8_t)(offset >> 8);
+    if (match_code >= 15 && !(len = lz_put_length(out, len, cap, match_code - 15))) {
+        return 0;
+    }
+    return len;
+}
+
+/* Greedy single-probe LZ77 in the LZ4 block format; returns 0 if it exceeds cap. */
+static uint32_t lz_encode(const uint8_t *block, uint8_t *out, uint32_t cap) {
+    uint16_t table[1U << LZ_HASH_BITS];
+    uint32_t anchor = 0;
+    uint32_t pos = 0;
+    uint32_t len = 0;
+    
+    memset(table, 0, sizeof(table));
+    while (pos + LZ_MIN_MATCH <= BLOCK_SIZE) {
+        uint32_t v = lz_load32(block + pos);
+        uint32_t h = lz_hash(v);
+        uint32_t cand = table[h];
+        table[h] = (uint16_t)(pos + 1);
+        
+        if (cand == 0 || lz_load32(block + cand - 1) != v) {
+            pos++;
+            continue;
+        }
+        
+        uint32_t ref = cand - 1;
+        uint32_t match_len = LZ_MIN_MATCH;
+        while (pos + match_len < BLOCK_SIZE && block[ref + match_len] == block[pos + match_len]) {
+            match_len++;
+        }
+        len = lz_put_sequence(out, len, cap, block + anchor, pos - anchor, pos - ref, match_len);
+        if (len == 0) {
+            return 0;
+        }
+        pos += match_len;
+        anchor = pos;
+    }
+    return lz_put_sequence(out, len, cap, block + anchor, BLOCK_SIZE - anchor, 0, 0);
+}
+
+static int lz_get_length(const uint8_t *in, uint32_t len, uint32_t *i, uint32_t *value) {
+    uint8_t b;
+    do {
+        if (*i >= len) {
+            return -1;
+        }
+        b = in[(*i)++];
+        *value += b;
+    } while (b == 255);
+    return 0;
+}
+
+static int lz_decode(const uint8_t *in, uint32_t len, uint8_t *block) {
+    uint32_t pos = 0;
+    uint32_t i = 0;
+    
+    while (i < len) {
+        uint8_t token = in[i++];
+        uint32_t lit_len = token >> 4;
+        if (lit_len == 15 && lz_get_length(in, len, &i, &lit_len) < 0) {
+            return -1;
+        }
+        if (i + lit_len > len || pos + lit_len > BLOCK_SIZE) {
+            return -1;
+        }
+        memcpy(block + pos, in + i, lit_len);
+        pos += lit_len;
+        i += lit_len;
+        if (i == len) {
+            break;
+        }
+        
+        if (i + 2 > len) {
+            return -1;
+        }
+        uint32_t offset = in[i] | (uint32_t)in[i + 1] << 8;
+        uint32_t match_len = token & 15;
+        i += 2;
+        if (match_len == 15 && lz_get_length(in, len, &i, &match_len) < 0) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > pos || pos + match_len > BLOCK_SIZE) {
+            return -1;
+        }
+        /* Byte at a time: matches may overlap their own output. */
+        for (uint32_t k = 0; k < match_len; ++k, ++pos) {
+            block[pos] = block[pos - offset];
+        }
+    }
+    return pos == BLOCK_SIZE ? 0 : -1;
+}
+
+/* Encodes block into out, returning the codec used or 0 if it should be logged raw. */
+static uint8_t encode_block(const uint8_t *block, uint8_t *out, uint32_t *out_len) {
+    uint8_t scratch[BLOCK_SIZE];
+    /* Anything that saves less than this is not worth a decode at install. */
+    uint32_t cap = BLOCK_SIZE - BLOCK_SIZE / 8;
+    uint8_t codec = 0;
+    int zr_len;
+    
+    if (compress_level >= 1 && (zr_len = zerorun_encode(block, out, cap)) >= 0) {
+        codec = ZCODEC_ZERORUN;
+        *out_len = (uint32_t)zr_len;
+        cap = zr_len > 0 ? *out_len - 1 : 0;
+    }
+    if (compress_level >= 2 && cap > 0) {
+        uint32_t lz_len = lz_encode(block, scratch, cap);
+        if (lz_len > 0) {
+            memcpy(out, scratch, lz_len);
+            *out_len = lz_len;
+            codec = ZCODEC_LZ;
+        }
+    }
+    return codec;
 }
 
-static void write_journal(int fd, const uint8_t *journal_data) {
-    for (uint32_t i = 0; i < JOURNAL_BLOCKS; ++i) {
-        pwrite_block(fd, JOURNAL_BLOCK_IDX + i, journal_data + (i * BLOCK_SIZE));
+static int decode_block(uint8_t codec, const uint8_t *in, uint32_t len, uint8_t *block) {
+    if (codec == ZCODEC_ZERORUN) {
+        return zerorun_decode(in, len, block);
+    }
+    if (codec == ZCODEC_LZ) {
+        return lz_decode(in, len, block);
     }
+    return -1;
 }
 
 static int append_data_record(uint8_t *journal_data, uint32_t block_no, const uint8_t *block_data) {
@@ -163,7 +941,6 @@ static int append_data_record(uint8_t *journal_data, uint32_t block_no, const ui
     uint32_t record_size = sizeof(struct rec_header) + sizeof(uint32_t) + BLOCK_SIZE;
     
     if (nbytes + record_size > JOURNAL_BLOCKS * BLOCK_SIZE) {
-        fprintf(stderr, "Journal full! Please run './journal install' first.\n");
         return -1;
     }
     
@@ -181,57 +958,944 @@ static int append_data_record(uint8_t *journal_data, uint32_t block_no, const ui
     nbytes += BLOCK_SIZE;
     
     jhdr->nbytes_used = nbytes;
+    VSFS_PROBE3(record__append, REC_DATA, block_no, record_size);
     
     return 0;
 }
 
-static int append_commit_record(uint8_t *journal_data) {
+static int append_zdata_record(uint8_t *journal_data, uint32_t block_no, uint8_t codec, const uint8_t *payload, uint32_t len) {
     struct journal_header *jhdr = (struct journal_header *)journal_data;
-    uint32_t nbytes = jhdr->nbytes_used;
+    struct zdata_record rec;
     
-    uint32_t record_size = sizeof(struct rec_header);
+    uint32_t size = ZDATA_RECORD_SIZE(len);
     
-    if (nbytes + record_size > JOURNAL_BLOCKS * BLOCK_SIZE) {
-        fprintf(stderr, "Journal full! Please run './journal install' first.\n");
+    if (jhdr->nbytes_used + size > JOURNAL_BLOCKS * BLOCK_SIZE) {
         return -1;
     }
     
-    struct rec_header rec_hdr;
-    rec_hdr.type = REC_COMMIT;
-    rec_hdr.size = record_size;
-    
-    memcpy(journal_data + nbytes, &rec_hdr, sizeof(rec_hdr));
-    nbytes += sizeof(rec_hdr);
+    memset(&rec, 0, sizeof(rec));
+    rec.hdr.type = REC_ZDATA;
+    rec.hdr.size = (uint16_t)size;
+    rec.block_no = block_no;
+    rec.codec = codec;
+    rec.tail = (uint8_t)(size - sizeof(rec) - len);
     
-    jhdr->nbytes_used = nbytes;
+    memcpy(journal_data + jhdr->nbytes_used, &rec, sizeof(rec));
+    memcpy(journal_data + jhdr->nbytes_used + sizeof(rec), payload, len);
+    memset(journal_data + jhdr->nbytes_used + sizeof(rec) + len, 0, rec.tail);
+    jhdr->nbytes_used += size;
+    VSFS_PROBE3(record__append, REC_ZDATA, block_no, rec.hdr.size);
     
     return 0;
 }
 
-static void cmd_create(int fd, const char *filename) {
-    struct superblock sb;
-    pread_block(fd, 0, &sb);
+static int append_commit_record(uint8_t *journal_data) {
+    struct journal_header *jhdr = (struct journal_header *)journal_data;
+    uint32_t nbytes = jhdr->nbytes_used;
     
-    init_journal(fd);
+    struct commit_record rec;
     
-    uint8_t *journal_data = read_journal(fd);
+    if (nbytes + sizeof(rec) > JOURNAL_BLOCKS * BLOCK_SIZE) {
+        return -1;
+    }
     
-    uint8_t inode_bitmap[BLOCK_SIZE];
-    uint8_t data_bitmap[BLOCK_SIZE];
-    pread_block(fd, INODE_BMAP_IDX, inode_bitmap);
-    pread_block(fd, DATA_BMAP_IDX, data_bitmap);
+    rec.hdr.type = REC_COMMIT;
+    rec.hdr.size = sizeof(rec);
+    rec.commit_time = (uint32_t)time(NULL);
+    rec.tid = ++jhdr->last_tid;
     
-    int free_inode = find_free_bit(inode_bitmap, sb.inode_count);
-    if (free_inode < 0) {
-        fprintf(stderr, "No free inodes available.\n");
-        free(journal_data);
-        return;
-    }
+    memcpy(journal_data + nbytes, &rec, sizeof(rec));
+    nbytes += sizeof(rec);
     
-    uint8_t root_data_block[BLOCK_SIZE];
-    pread_block(fd, DATA_START_IDX, root_data_block);
-    struct dirent *dirents = (struct dirent *)root_data_block;
+    jhdr->nbytes_used = nbytes;
     
+    return 0;
+}
+
+struct deferred_free {
+    uint32_t bitmap_block;
+    uint32_t bit;
+};
+
+/*
+ * Working copies of the blocks one transaction modifies, each logged once at
+ * commit. Bitmap frees are queued and applied together just before logging.
+ */
+struct txn {
+    struct block_cache *cache;
+    uint32_t count;
+    uint32_t block_no[TXN_MAX_BLOCKS];
+    uint8_t *data[TXN_MAX_BLOCKS];
+    struct deferred_free *frees;
+    uint32_t nfrees;
+    uint32_t free_cap;
+    uint32_t *revokes;
+    uint32_t nrevokes;
+    uint32_t revoke_cap;
+    const struct create_record *logical;
+    uint32_t nlogical;
+};
+
+static void txn_begin(struct txn *txn, struct block_cache *cache) {
+    memset(txn, 0, sizeof(*txn));
+    txn->cache = cache;
+    VSFS_PROBE1(tx__begin, txn);
+}
+
+/* Returns the transaction's copy of block_no, loading it unless fill is 0 (zeroed). */
+static uint8_t *txn_block(struct txn *txn, uint32_t block_no, int fill) {
+    for (uint32_t i = 0; i < txn->count; ++i) {
+        if (txn->block_no[i] == block_no) {
+            return txn->data[i];
+        }
+    }
+    if (txn->count >= TXN_MAX_BLOCKS) {
+        fprintf(stderr, "Transaction exceeds %u blocks\n", TXN_MAX_BLOCKS);
+        exit(EXIT_FAILURE);
+    }
+    uint8_t *data = calloc(1, BLOCK_SIZE);
+    if (!data) {
+        die("malloc txn block");
+    }
+    if (fill) {
+        cache_read_block(txn->cache, block_no, data);
+    }
+    txn->block_no[txn->count] = block_no;
+    txn->data[txn->count] = data;
+    txn->count++;
+    return data;
+}
+
+static void txn_defer_free(struct txn *txn, uint32_t bitmap_block, uint32_t bit) {
+    if (txn->nfrees == txn->free_cap) {
+        uint32_t cap = txn->free_cap ? txn->free_cap * 2 : 16;
+        struct deferred_free *frees = realloc(txn->frees, cap * sizeof(*frees));
+        if (!frees) {
+            die("malloc deferred frees");
+        }
+        txn->frees = frees;
+        txn->free_cap = cap;
+    }
+    txn->frees[txn->nfrees].bitmap_block = bitmap_block;
+    txn->frees[txn->nfrees].bit = bit;
+    txn->nfrees++;
+}
+
+/* Marks a freed block so replay skips every copy logged up to this transaction. */
+static void txn_revoke(struct txn *txn, uint32_t block_no) {
+    if (txn->nrevokes == txn->revoke_cap) {
+        uint32_t cap = txn->revoke_cap ? txn->revoke_cap * 2 : 16;
+        uint32_t *revokes = realloc(txn->revokes, cap * sizeof(*revokes));
+        if (!revokes) {
+            die("malloc revokes");
+        }
+        txn->revokes = revokes;
+        txn->revoke_cap = cap;
+    }
+    txn->revokes[txn->nrevokes++] = block_no;
+}
+
+static void txn_apply_frees(struct txn *txn) {
+    for (uint32_t i = 0; i < txn->nfrees; ++i) {
+        uint8_t *bitmap = txn_block(txn, txn->frees[i].bitmap_block, 1);
+        uint32_t bit = txn->frees[i].bit;
+        if (bitmap_test(bitmap, bit)) {
+            bitmap[bit / 8] &= (uint8_t)~(1U << (bit % 8));
+            bitmap_summary(bitmap)->free_count++;
+        }
+    }
+    txn->nfrees = 0;
+}
+
+static void txn_end(struct txn *txn) {
+    for (uint32_t i = 0; i < txn->count; ++i) {
+        free(txn->data[i]);
+    }
+    free(txn->frees);
+    free(txn->revokes);
+    memset(txn, 0, sizeof(*txn));
+}
+
+static int txn_logs_block(const struct txn *txn, uint32_t block_no) {
+    for (uint32_t i = 0; i < txn->count; ++i) {
+        if (txn->block_no[i] == block_no) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* The transaction's copy of block_no if it logs one, else the cached block read into scratch. */
+static const uint8_t *txn_peek(struct txn *txn, uint32_t block_no, uint8_t *scratch) {
+    for (uint32_t i = 0; i < txn->count; ++i) {
+        if (txn->block_no[i] == block_no) {
+            return txn->data[i];
+        }
+    }
+    cache_read_block(txn->cache, block_no, scratch);
+    return scratch;
+}
+
+/* Blocks an inode from [first, first + INODES_PER_BLOCK) of group g would add to txn. */
+static uint32_t inode_slot_cost(const struct txn *txn, uint32_t g, uint32_t first, int uninit) {
+    uint32_t cost = !txn_logs_block(txn, GROUP_INODE_BMAP(g));
+    if (!uninit) {
+        return cost + !txn_logs_block(txn, GROUP_INODE_START(g) + first / INODES_PER_BLOCK);
+    }
+    for (uint32_t i = 0; i < GROUP_INODE_BLOCKS; ++i) {
+        cost += !txn_logs_block(txn, GROUP_INODE_START(g) + i);
+    }
+    return cost;
+}
+
+/*
+ * Picks the inode-table block for a new inode that adds the fewest blocks to txn,
+ * so a create lands next to its parent's inode and a transaction allocating several
+ * inodes keeps reusing the bitmaps and tables it already logs. Ties go to initialized
+ * groups, then the parent's group, then the group with the most free inodes. Returns
+ * the group and its local inode range in [*first, *end), or -1 when no inode is free.
+ */
+static int pick_inode_slot(struct txn *txn, uint32_t parent_ino, uint32_t *first, uint32_t *end) {
+    uint32_t parent_group = parent_ino / INODES_PER_GROUP;
+    uint32_t best_cost = UINT32_MAX;
+    uint32_t best_rank = 0;
+    int best = -1;
+    uint8_t scratch[BLOCK_SIZE];
+    
+    for (uint32_t g = 0; g < GROUP_COUNT; ++g) {
+        const uint8_t *bitmap = txn_peek(txn, GROUP_INODE_BMAP(g), scratch);
+        struct group_summary summary;
+        memcpy(&summary, bitmap + SUMMARY_OFFSET, sizeof(summary));
+        if (summary.free_count == 0) {
+            continue;
+        }
+        int uninit = (summary.flags & GROUP_INODE_UNINIT) != 0;
+        uint32_t rank = summary.free_count;
+        if (g == parent_group) {
+            rank += INODES_PER_GROUP + 1;
+        }
+        if (!uninit) {
+            rank += 2 * (INODES_PER_GROUP + 1);
+        }
+        
+        for (uint32_t lo = 0; lo < INODES_PER_GROUP; lo += INODES_PER_BLOCK) {
+            uint32_t hi = lo + INODES_PER_BLOCK < INODES_PER_GROUP ? lo + INODES_PER_BLOCK : INODES_PER_GROUP;
+            uint32_t free_here = 0;
+            for (uint32_t i = lo; i < hi && !free_here; ++i) {
+                free_here = !bitmap_test(bitmap, i);
+            }
+            if (!free_here) {
+                continue;
+            }
+            uint32_t cost = inode_slot_cost(txn, g, lo, uninit);
+            if (cost < best_cost || (cost == best_cost && rank > best_rank)) {
+                best_cost = cost;
+                best_rank = rank;
+                best = (int)g;
+                *first = lo;
+                *end = hi;
+            }
+        }
+    }
+    return best;
+}
+
+/* Revokes of blocks the transaction logs again are dropped; the new copy wins. */
+static uint32_t txn_live_revokes(const struct txn *txn) {
+    uint32_t live = 0;
+    for (uint32_t i = 0; i < txn->nrevokes; ++i) {
+        live += !txn_logs_block(txn, txn->revokes[i]);
+    }
+    return live;
+}
+
+static void append_revoke_record(uint8_t *journal_data, const struct txn *txn, uint32_t live) {
+    struct journal_header *jhdr = (struct journal_header *)journal_data;
+    uint32_t nbytes = jhdr->nbytes_used;
+    struct revoke_record rec;
+    
+    rec.hdr.type = REC_REVOKE;
+    rec.hdr.size = (uint16_t)(sizeof(rec) + live * sizeof(uint32_t));
+    rec.count = live;
+    memcpy(journal_data + nbytes, &rec, sizeof(rec));
+    nbytes += sizeof(rec);
+    
+    for (uint32_t i = 0; i < txn->nrevokes; ++i) {
+        if (!txn_logs_block(txn, txn->revokes[i])) {
+            memcpy(journal_data + nbytes, &txn->revokes[i], sizeof(uint32_t));
+            nbytes += sizeof(uint32_t);
+        }
+    }
+    jhdr->nbytes_used = nbytes;
+}
+
+/* Descriptor size that ends on the next block boundary with room for count entries. */
+static uint32_t desc_record_size(uint32_t offset, uint32_t count) {
+    uint32_t min = sizeof(struct desc_record) + count * sizeof(uint32_t);
+    uint32_t end = (offset + min + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    return end - offset;
+}
+
+static void append_desc_record(uint8_t *journal_data, const struct txn *txn) {
+    struct journal_header *jhdr = (struct journal_header *)journal_data;
+    uint32_t nbytes = jhdr->nbytes_used;
+    struct desc_record rec;
+    
+    rec.hdr.type = REC_DESC;
+    rec.hdr.size = (uint16_t)desc_record_size(nbytes, txn->count);
+    rec.count = txn->count;
+    memset(journal_data + nbytes, 0, rec.hdr.size);
+    memcpy(journal_data + nbytes, &rec, sizeof(rec));
+    memcpy(journal_data + nbytes + sizeof(rec), txn->block_no, txn->count * sizeof(uint32_t));
+    nbytes += rec.hdr.size;
+    
+    for (uint32_t i = 0; i < txn->count; ++i) {
+        memcpy(journal_data + nbytes, txn->data[i], BLOCK_SIZE);
+        nbytes += BLOCK_SIZE;
+        VSFS_PROBE3(record__append, REC_DESC, txn->block_no[i], BLOCK_SIZE);
+    }
+    jhdr->nbytes_used = nbytes;
+}
+
+static int append_aligned_transaction(uint8_t *journal_data, const struct txn *txn, uint32_t live) {
+    struct journal_header *jhdr = (struct journal_header *)journal_data;
+    uint32_t offset = jhdr->nbytes_used;
+    
+    if (live > 0) {
+        offset += sizeof(struct revoke_record) + live * sizeof(uint32_t);
+    }
+    if (txn->count > 0) {
+        offset += desc_record_size(offset, txn->count) + txn->count * BLOCK_SIZE;
+    }
+    if (offset + sizeof(struct commit_record) > JOURNAL_BLOCKS * BLOCK_SIZE) {
+        return -1;
+    }
+    
+    if (live > 0) {
+        append_revoke_record(journal_data, txn, live);
+    }
+    if (txn->count > 0) {
+        append_desc_record(journal_data, txn);
+    }
+    return append_commit_record(journal_data);
+}
+
+/* A logical transaction replaces all of its block images with its operation records. */
+static int append_logical_transaction(uint8_t *journal_data, const struct txn *txn) {
+    struct journal_header *jhdr = (struct journal_header *)journal_data;
+    uint32_t size = txn->nlogical * sizeof(struct create_record);
+    
+    if (jhdr->nbytes_used + size + sizeof(struct commit_record) > JOURNAL_BLOCKS * BLOCK_SIZE) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < txn->nlogical; ++i) {
+        memcpy(journal_data + jhdr->nbytes_used, &txn->logical[i], sizeof(struct create_record));
+        jhdr->nbytes_used += sizeof(struct create_record);
+        VSFS_PROBE3(record__append, REC_CREATE, txn->logical[i].ino, sizeof(struct create_record));
+    }
+    return append_commit_record(journal_data);
+}
+
+static int append_transaction(uint8_t *journal_data, const struct txn *txn) {
+    struct journal_header *jhdr = (struct journal_header *)journal_data;
+    uint32_t raw_size = sizeof(struct data_record);
+    uint32_t live = txn_live_revokes(txn);
+    
+    if (txn->logical) {
+        return append_logical_transaction(journal_data, txn);
+    }
+    if (journal_aligned) {
+        return append_aligned_transaction(journal_data, txn, live);
+    }
+    
+    uint32_t needed = sizeof(struct commit_record);
+    uint8_t codec[TXN_MAX_BLOCKS];
+    uint32_t encoded_len[TXN_MAX_BLOCKS];
+    uint8_t *encoded = malloc(txn->count * BLOCK_SIZE + 1);
+    
+    if (!encoded) {
+        die("malloc");
+    }
+    if (live > 0) {
+        needed += sizeof(struct revoke_record) + live * sizeof(uint32_t);
+    }
+    for (uint32_t i = 0; i < txn->count; ++i) {
+        codec[i] = encode_block(txn->data[i], encoded + i * BLOCK_SIZE, &encoded_len[i]);
+        needed += codec[i] ? ZDATA_RECORD_SIZE(encoded_len[i]) : raw_size;
+    }
+    
+    if (jhdr->nbytes_used + needed > JOURNAL_BLOCKS * BLOCK_SIZE) {
+        free(encoded);
+        return -1;
+    }
+    if (live > 0) {
+        append_revoke_record(journal_data, txn, live);
+    }
+    for (uint32_t i = 0; i < txn->count; ++i) {
+        if (codec[i]) {
+            append_zdata_record(journal_data, txn->block_no[i], codec[i], encoded + i * BLOCK_SIZE, encoded_len[i]);
+        }
+        else {
+            append_data_record(journal_data, txn->block_no[i], txn->data[i]);
+        }
+    }
+    free(encoded);
+    return append_commit_record(journal_data);
+}
+
+struct checkpoint_policy {
+    uint32_t fill_pct;
+    uint32_t max_age;
+    uint32_t max_txns;
+    uint32_t progress_blocks;
+};
+
+static struct checkpoint_policy ckpt_policy = {
+    CKPT_DEFAULT_FILL_PCT, CKPT_DEFAULT_MAX_AGE, CKPT_DEFAULT_MAX_TXNS, CKPT_DEFAULT_PROGRESS,
+};
+
+/* Bytes from rec_hdr to the next record, including a descriptor's payload blocks. */
+static uint32_t record_length(const struct rec_header *rec_hdr) {
+    if (rec_hdr->type == REC_DESC) {
+        return rec_hdr->size + ((const struct desc_record *)rec_hdr)->count * BLOCK_SIZE;
+    }
+    return rec_hdr->size;
+}
+
+static uint32_t journal_oldest_commit(const uint8_t *journal_data) {
+    const struct journal_header *jhdr = (const struct journal_header *)journal_data;
+    uint32_t offset = sizeof(struct journal_header);
+    
+    while (offset + sizeof(struct rec_header) <= jhdr->nbytes_used) {
+        const struct rec_header *rec_hdr = (const struct rec_header *)(journal_data + offset);
+        if (rec_hdr->size < sizeof(struct rec_header)) {
+            break;
+        }
+        if (rec_hdr->type == REC_COMMIT && rec_hdr->size >= sizeof(struct commit_record)
+            && offset + sizeof(struct commit_record) <= jhdr->nbytes_used) {
+            const struct commit_record *commit = (const struct commit_record *)rec_hdr;
+            if (commit->tid > jhdr->checkpoint_tid) {
+                return commit->commit_time;
+            }
+        }
+        offset += record_length(rec_hdr);
+    }
+    return 0;
+}
+
+static int checkpoint_due(const uint8_t *journal_data, int committed) {
+    const struct journal_header *jhdr = (const struct journal_header *)journal_data;
+    
+    if (committed == 0) {
+        return 0;
+    }
+    if ((uint64_t)jhdr->nbytes_used * 100 >= (uint64_t)ckpt_policy.fill_pct * JOURNAL_BLOCKS * BLOCK_SIZE) {
+        return 1;
+    }
+    if (ckpt_policy.max_txns > 0 && (uint32_t)committed >= ckpt_policy.max_txns) {
+        return 1;
+    }
+    if (ckpt_policy.max_age > 0) {
+        uint32_t oldest = journal_oldest_commit(journal_data);
+        if (oldest != 0 && (uint32_t)time(NULL) - oldest >= ckpt_policy.max_age) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Returns the size of the well-formed record at offset, or 0 if it is truncated or unknown. */
+static uint32_t record_span(const uint8_t *journal_data, uint32_t offset, uint32_t end) {
+    if (offset + sizeof(struct rec_header) > end) {
+        fprintf(stderr, "Incomplete record header at offset %u\n", offset);
+        return 0;
+    }
+    
+    const struct rec_header *rec_hdr = (const struct rec_header *)(journal_data + offset);
+    
+    if (rec_hdr->size < sizeof(struct rec_header) || offset + rec_hdr->size > end) {
+        fprintf(stderr, "Bad record size %u at offset %u\n", rec_hdr->size, offset);
+        return 0;
+    }
+    
+    if (rec_hdr->type == REC_DATA) {
+        if (rec_hdr->size < sizeof(struct rec_header) + sizeof(uint32_t) + BLOCK_SIZE) {
+            fprintf(stderr, "Incomplete data record at offset %u\n", offset);
+            return 0;
+        }
+    }
+    else if (rec_hdr->type == REC_ZDATA) {
+        /* The payload is checked where replay decodes it. */
+        const struct zdata_record *rec = (const struct zdata_record *)rec_hdr;
+        if (rec_hdr->size < sizeof(*rec) + rec->tail || rec->tail > 3
+            || (rec->codec != ZCODEC_ZERORUN && rec->codec != ZCODEC_LZ)) {
+            fprintf(stderr, "Corrupt compressed record at offset %u\n", offset);
+            return 0;
+        }
+    }
+    else if (rec_hdr->type == REC_DESC) {
+        const struct desc_record *rec = (const struct desc_record *)rec_hdr;
+        if (rec_hdr->size < sizeof(*rec) || rec->count > JOURNAL_BLOCKS
+            || rec_hdr->size < sizeof(*rec) + rec->count * sizeof(uint32_t) || (offset + rec_hdr->size) % BLOCK_SIZE != 0
+            || offset + rec_hdr->size + rec->count * BLOCK_SIZE > end) {
+            fprintf(stderr, "Bad descriptor record at offset %u\n", offset);
+            return 0;
+        }
+    }
+    else if (rec_hdr->type == REC_REVOKE) {
+        const struct revoke_record *rec = (const struct revoke_record *)rec_hdr;
+        if (rec_hdr->size < sizeof(*rec) || rec->count > TOTAL_BLOCKS
+            || rec_hdr->size < sizeof(*rec) + rec->count * sizeof(uint32_t)) {
+            fprintf(stderr, "Incomplete revoke record at offset %u\n", offset);
+            return 0;
+        }
+    }
+    else if (rec_hdr->type == REC_COMMIT) {
+        if (rec_hdr->size < sizeof(struct commit_record)) {
+            fprintf(stderr, "Incomplete commit record at offset %u\n", offset);
+            return 0;
+        }
+    }
+    else if (rec_hdr->type == REC_PAD) {
+        /* Only the size matters, and it was checked above. */
+    }
+    else if (rec_hdr->type == REC_CREATE) {
+        const struct create_record *rec = (const struct create_record *)rec_hdr;
+        if (rec_hdr->size < sizeof(*rec) || rec->ino == 0 || rec->ino >= GROUP_COUNT * INODES_PER_GROUP
+            || rec->slot >= BLOCK_SIZE / sizeof(struct dirent)) {
+            fprintf(stderr, "Bad create record at offset %u\n", offset);
+            return 0;
+        }
+    }
+    else {
+        fprintf(stderr, "Unknown record type %u at offset %u\n", rec_hdr->type, offset);
+        return 0;
+    }
+    return record_length(rec_hdr);
+}
+
+/* Number of home blocks a record logs. */
+static uint32_t record_blocks(const struct rec_header *rec_hdr) {
+    if (rec_hdr->type == REC_DATA || rec_hdr->type == REC_ZDATA) {
+        return 1;
+    }
+    if (rec_hdr->type == REC_DESC) {
+        return ((const struct desc_record *)rec_hdr)->count;
+    }
+    return 0;
+}
+
+static uint32_t record_block_no(const struct rec_header *rec_hdr, uint32_t i) {
+    uint32_t block_no;
+    if (rec_hdr->type == REC_DESC) {
+        memcpy(&block_no, (const uint8_t *)rec_hdr + sizeof(struct desc_record) + i * sizeof(uint32_t), sizeof(block_no));
+    }
+    else {
+        memcpy(&block_no, (const uint8_t *)rec_hdr + sizeof(struct rec_header), sizeof(block_no));
+    }
+    return block_no;
+}
+
+/* Returns the logged contents of block i of an uncompressed record. */
+static const uint8_t *record_block_image(const struct rec_header *rec_hdr, uint32_t i) {
+    if (rec_hdr->type == REC_DESC) {
+        return (const uint8_t *)rec_hdr + rec_hdr->size + i * BLOCK_SIZE;
+    }
+    return (const uint8_t *)rec_hdr + sizeof(struct rec_header) + sizeof(uint32_t);
+}
+
+/*
+ * Decodes every compressed record in [from, to) into staged, one block each in
+ * record order, growing it as needed. Returns -1 at the first corrupt payload.
+ */
+static int decode_transaction(const uint8_t *journal_data, uint32_t from, uint32_t to, uint8_t **staged, uint32_t *cap) {
+    uint32_t n = 0;
+    for (uint32_t at = from; at < to; at += record_length((const struct rec_header *)(journal_data + at))) {
+        const struct rec_header *rec_hdr = (const struct rec_header *)(journal_data + at);
+        if (rec_hdr->type != REC_ZDATA) {
+            continue;
+        }
+        if (n == *cap) {
+            uint32_t grown = *cap ? *cap * 2 : TXN_MAX_BLOCKS;
+            uint8_t *blocks = realloc(*staged, (size_t)grown * BLOCK_SIZE);
+            if (!blocks) {
+                die("malloc staged blocks");
+            }
+            *staged = blocks;
+            *cap = grown;
+        }
+        const struct zdata_record *rec = (const struct zdata_record *)rec_hdr;
+        if (decode_block(rec->codec, (const uint8_t *)(rec + 1), rec_hdr->size - sizeof(*rec) - rec->tail, *staged + (size_t)n * BLOCK_SIZE) < 0) {
+            fprintf(stderr, "Corrupt compressed record at offset %u\n", at);
+            return -1;
+        }
+        n++;
+    }
+    return 0;
+}
+
+/* Home blocks a create record may change: its group's inode bitmap and table, the directory and the root inode. */
+static uint32_t create_record_blocks(const struct create_record *rec, uint32_t *blocks) {
+    uint32_t group = rec->ino / INODES_PER_GROUP;
+    uint32_t n = 0;
+    blocks[n++] = GROUP_INODE_BMAP(group);
+    for (uint32_t i = 0; i < GROUP_INODE_BLOCKS; ++i) {
+        blocks[n++] = GROUP_INODE_START(group) + i;
+    }
+    blocks[n++] = DATA_START_IDX;
+    if (inode_block_no(0) != GROUP_INODE_START(group)) {
+        blocks[n++] = inode_block_no(0);
+    }
+    return n;
+}
+
+/*
+ * Redoes a create on the cached blocks. Each step converges instead of
+ * accumulating, so it is safe on blocks a partial install already wrote back:
+ * the bitmap bit and free count change only if the bit is clear, and the inode,
+ * the dirent and the root size are overwritten.
+ */
+static void redo_create(struct block_cache *cache, const struct create_record *rec) {
+    uint32_t group = rec->ino / INODES_PER_GROUP;
+    uint32_t local = rec->ino % INODES_PER_GROUP;
+    uint8_t block[BLOCK_SIZE];
+    
+    cache_read_block(cache, GROUP_INODE_BMAP(group), block);
+    struct group_summary *summary = bitmap_summary(block);
+    if (summary->flags & GROUP_INODE_UNINIT) {
+        summary->flags &= ~GROUP_INODE_UNINIT;
+        uint8_t zero[BLOCK_SIZE];
+        memset(zero, 0, sizeof(zero));
+        for (uint32_t i = 0; i < GROUP_INODE_BLOCKS; ++i) {
+            cache_write_block(cache, GROUP_INODE_START(group) + i, zero);
+        }
+    }
+    if (!bitmap_test(block, local)) {
+        block[local / 8] |= (uint8_t)(1U << (local % 8));
+        summary->free_count--;
+    }
+    cache_write_block(cache, GROUP_INODE_BMAP(group), block);
+    
+    struct inode inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.type = 1;
+    inode.links = 1;
+    inode.ctime = rec->time;
+    inode.mtime = rec->time;
+    cache_read_block(cache, inode_block_no(rec->ino), block);
+    memcpy(block + (rec->ino % INODES_PER_BLOCK) * INODE_SIZE, &inode, sizeof(inode));
+    cache_write_block(cache, inode_block_no(rec->ino), block);
+    
+    cache_read_block(cache, DATA_START_IDX, block);
+    struct dirent *dirents = (struct dirent *)block;
+    dirents[rec->slot].inode = rec->ino;
+    memcpy(dirents[rec->slot].name, rec->name, sizeof(dirents[rec->slot].name));
+    dirents[rec->slot].name[sizeof(dirents[rec->slot].name) - 1] = '\0';
+    uint32_t size = dir_size(dirents);
+    cache_write_block(cache, DATA_START_IDX, block);
+    
+    cache_read_block(cache, inode_block_no(0), block);
+    struct inode *root_inode = (struct inode *)block;
+    root_inode->size = size;
+    if (root_inode->mtime < rec->time) {
+        root_inode->mtime = rec->time;
+    }
+    cache_write_block(cache, inode_block_no(0), block);
+}
+
+/*
+ * Brings the root inode in line with its replayed directory block: the size follows
+ * the entries and the mtime is at least the last commit that logged the block. This
+ * is how lazytime creates, which skip the root inode, reach disk.
+ */
+static void fold_root_times(struct block_cache *cache, uint32_t dir_mtime) {
+    uint8_t dir_block[BLOCK_SIZE];
+    uint8_t inode_block[BLOCK_SIZE];
+    
+    cache_read_block(cache, DATA_START_IDX, dir_block);
+    cache_read_block(cache, inode_block_no(0), inode_block);
+    struct inode *root_inode = (struct inode *)inode_block;
+    uint32_t size = dir_size((const struct dirent *)dir_block);
+    if (root_inode->size == size && root_inode->mtime >= dir_mtime) {
+        return;
+    }
+    root_inode->size = size;
+    if (root_inode->mtime < dir_mtime) {
+        root_inode->mtime = dir_mtime;
+    }
+    cache_write_block(cache, inode_block_no(0), inode_block);
+}
+
+/*
+ * Applies the data records of every committed transaction newer than the
+ * checkpoint TID to the cache and returns how many there were. A revoke in
+ * transaction N suppresses copies of its blocks from transactions up to and
+ * including N.
+ */
+static int replay_journal(const uint8_t *journal_data, struct block_cache *cache) {
+    const struct journal_header *jhdr = (const struct journal_header *)journal_data;
+    int revoked_until[TOTAL_BLOCKS];
+    uint32_t offset = sizeof(struct journal_header);
+    uint32_t txn_start = offset;
+    uint32_t live_start = offset;
+    uint32_t committed_end = offset;
+    int ordinal = 0;
+    int first_live = 0;
+    
+    for (uint32_t b = 0; b < TOTAL_BLOCKS; ++b) {
+        revoked_until[b] = -1;
+    }
+    
+    while (offset < jhdr->nbytes_used) {
+        uint32_t span = record_span(journal_data, offset, jhdr->nbytes_used);
+        if (span == 0) {
+            break;
+        }
+        const struct rec_header *rec_hdr = (const struct rec_header *)(journal_data + offset);
+        offset += span;
+        if (rec_hdr->type != REC_COMMIT) {
+            continue;
+        }
+        
+        while (txn_start < offset) {
+            const struct rec_header *rec = (const struct rec_header *)(journal_data + txn_start);
+            if (rec->type == REC_REVOKE) {
+                const struct revoke_record *revoke = (const struct revoke_record *)rec;
+                const uint8_t *blocks = journal_data + txn_start + sizeof(*revoke);
+                for (uint32_t i = 0; i < revoke->count; ++i) {
+                    uint32_t block_no;
+                    memcpy(&block_no, blocks + i * sizeof(uint32_t), sizeof(block_no));
+                    if (block_no < TOTAL_BLOCKS) {
+                        revoked_until[block_no] = ordinal;
+                    }
+                }
+            }
+            txn_start += record_length(rec);
+        }
+        ordinal++;
+        committed_end = offset;
+        /* TIDs only grow, so checkpointed transactions form a prefix. */
+        if (((const struct commit_record *)rec_hdr)->tid <= jhdr->checkpoint_tid) {
+            first_live = ordinal;
+            live_start = offset;
+        }
+    }
+    
+    /* A transaction whose compressed images do not all decode ends the replay, as a bad record does above. */
+    int txn = first_live;
+    uint32_t dir_mtime = 0;
+    uint8_t *staged = NULL;
+    uint32_t staged_cap = 0;
+    for (offset = live_start; offset < committed_end; txn++) {
+        uint32_t txn_end = offset;
+        while (((const struct rec_header *)(journal_data + txn_end))->type != REC_COMMIT) {
+            txn_end += record_length((const struct rec_header *)(journal_data + txn_end));
+        }
+        txn_end += record_length((const struct rec_header *)(journal_data + txn_end));
+        if (decode_transaction(journal_data, offset, txn_end, &staged, &staged_cap) < 0) {
+            break;
+        }
+        
+        int dir_logged = 0;
+        uint32_t nstaged = 0;
+        for (; offset < txn_end; offset += record_length((const struct rec_header *)(journal_data + offset))) {
+            const struct rec_header *rec_hdr = (const struct rec_header *)(journal_data + offset);
+            for (uint32_t i = 0; i < record_blocks(rec_hdr); ++i) {
+                uint32_t block_no = record_block_no(rec_hdr, i);
+                const uint8_t *image = rec_hdr->type == REC_ZDATA ? staged + (size_t)nstaged++ * BLOCK_SIZE : record_block_image(rec_hdr, i);
+                if (block_no >= TOTAL_BLOCKS || revoked_until[block_no] < txn) {
+                    cache_write_block(cache, block_no, image);
+                    dir_logged |= block_no == DATA_START_IDX;
+                }
+            }
+            if (rec_hdr->type == REC_CREATE) {
+                redo_create(cache, (const struct create_record *)rec_hdr);
+            }
+            if (rec_hdr->type == REC_COMMIT && dir_logged) {
+                dir_mtime = ((const struct commit_record *)rec_hdr)->commit_time;
+            }
+        }
+    }
+    free(staged);
+    if (dir_mtime != 0) {
+        fold_root_times(cache, dir_mtime);
+    }
+    
+    return txn - first_live;
+}
+
+/* Appends the dirty cached blocks logged in [from, to) to batch; returns the new batch size. */
+static uint32_t collect_logged_blocks(struct block_cache *cache, const uint8_t *journal_data, uint32_t from, uint32_t to, struct cache_entry **batch, uint32_t count) {
+    while (from < to) {
+        const struct rec_header *rec_hdr = (const struct rec_header *)(journal_data + from);
+        for (uint32_t i = 0; i < record_blocks(rec_hdr); ++i) {
+            uint32_t block_no = record_block_no(rec_hdr, i);
+            struct cache_entry *entry = cache_take_dirty(cache, block_no);
+            if (entry) {
+                batch[count++] = entry;
+            }
+            /* The root inode's folded size and mtime go out with the directory block they describe. */
+            if (block_no == DATA_START_IDX && (entry = cache_take_dirty(cache, inode_block_no(0)))) {
+                batch[count++] = entry;
+            }
+        }
+        if (rec_hdr->type == REC_CREATE) {
+            uint32_t blocks[GROUP_INODE_BLOCKS + 3];
+            uint32_t n = create_record_blocks((const struct create_record *)rec_hdr, blocks);
+            for (uint32_t i = 0; i < n; ++i) {
+                struct cache_entry *entry = cache_take_dirty(cache, blocks[i]);
+                if (entry) {
+                    batch[count++] = entry;
+                }
+            }
+        }
+        from += record_length(rec_hdr);
+    }
+    return count;
+}
+
+/*
+ * Writes back replayed blocks in committed-transaction order, in parallel
+ * batches of at least progress_blocks, recording the checkpoint TID after
+ * each batch so an interrupted install resumes after the last recorded
+ * transaction, then empties the journal.
+ */
+static void checkpoint_journal(struct block_cache *cache, uint8_t *journal_data) {
+    struct journal_header *jhdr = (struct journal_header *)journal_data;
+    uint32_t offset = sizeof(struct journal_header);
+    uint32_t txn_start = offset;
+    struct writeback_pool pool;
+    struct cache_entry **batch = malloc((cache->count + 1) * sizeof(*batch));
+    uint32_t count = 0;
+    uint64_t start = lat_now();
+    
+    if (!batch) {
+        die("malloc flush batch");
+    }
+    VSFS_PROBE2(checkpoint__start, jhdr->checkpoint_tid, jhdr->last_tid);
+    pool_start(&pool, cache->dev, writeback_threads);
+    
+    while (offset < jhdr->nbytes_used) {
+        const struct rec_header *rec_hdr = (const struct rec_header *)(journal_data + offset);
+        uint32_t len = record_length(rec_hdr);
+        if (len < sizeof(struct rec_header) || offset + len > jhdr->nbytes_used) {
+            break;
+        }
+        offset += len;
+        if (rec_hdr->type != REC_COMMIT) {
+            continue;
+        }
+        
+        const struct commit_record *commit = (const struct commit_record *)rec_hdr;
+        if (commit->tid > jhdr->checkpoint_tid) {
+            count = collect_logged_blocks(cache, journal_data, txn_start, offset, batch, count);
+            if (count > 0 && count >= ckpt_policy.progress_blocks) {
+                pool_write(&pool, batch, count);
+                count = 0;
+                jhdr->checkpoint_tid = commit->tid;
+                bdev_write(cache->dev, JOURNAL_BLOCK_IDX, journal_data);
+            }
+        }
+        txn_start = offset;
+    }
+    
+    pool_write(&pool, batch, count);
+    cache_flush(cache, &pool);
+    pool_stop(&pool);
+    free(batch);
+    jhdr->checkpoint_tid = jhdr->last_tid;
+    jhdr->nbytes_used = sizeof(struct journal_header);
+    write_journal(cache->dev, journal_data, 0);
+    VSFS_PROBE1(checkpoint__done, jhdr->checkpoint_tid);
+    lat_record_since(lat_hist("checkpoint"), start);
+}
+
+/* Locks the whole image, then checkpoints a fresh copy of the journal and returns it. */
+static uint8_t *checkpoint_exclusive(struct block_cache *cache, uint8_t *journal_data) {
+    free(journal_data);
+    lock_image(cache->fd, F_WRLCK);
+    journal_data = read_journal(cache->dev);
+    replay_journal(journal_data, cache);
+    checkpoint_journal(cache, journal_data);
+    return journal_data;
+}
+
+/* Logs txn, checkpointing first if the journal cannot hold it, then caches its blocks. */
+static int commit_transaction(struct txn *txn) {
+    struct block_cache *cache = txn->cache;
+    uint64_t start = lat_now();
+    txn_apply_frees(txn);
+    
+    lock_journal(cache->fd, F_WRLCK);
+    uint8_t *journal_data = read_journal(cache->dev);
+    struct journal_header *jhdr = (struct journal_header *)journal_data;
+    uint32_t journal_tail = jhdr->nbytes_used;
+    
+    if (append_transaction(journal_data, txn) < 0) {
+        lock_journal(cache->fd, F_UNLCK);
+        journal_data = checkpoint_exclusive(cache, journal_data);
+        jhdr = (struct journal_header *)journal_data;
+        journal_tail = jhdr->nbytes_used;
+        if (append_transaction(journal_data, txn) < 0) {
+            fprintf(stderr, "Transaction does not fit in an empty journal.\n");
+            free(journal_data);
+            return -1;
+        }
+    }
+    
+    write_journal(cache->dev, journal_data, journal_tail);
+    lock_journal(cache->fd, F_UNLCK);
+    journal_bytes_logged += jhdr->nbytes_used - journal_tail;
+    VSFS_PROBE3(tx__commit, jhdr->last_tid, txn->count, jhdr->nbytes_used - journal_tail);
+    free(journal_data);
+    lat_record_since(lat_hist("commit"), start);
+    
+    for (uint32_t i = 0; i < txn->nrevokes; ++i) {
+        if (!txn_logs_block(txn, txn->revokes[i])) {
+            cache_discard(cache, txn->revokes[i]);
+        }
+    }
+    for (uint32_t i = 0; i < txn->count; ++i) {
+        cache_write_block(cache, txn->block_no[i], txn->data[i]);
+    }
+    return 0;
+}
+
+/* Brings the cache up to date with the committed journal, checkpointing if policy says so. */
+static void sync_with_journal(struct block_cache *cache) {
+    lock_journal(cache->fd, F_WRLCK);
+    uint8_t *journal_data = read_journal(cache->dev);
+    init_journal(cache->dev, journal_data);
+    int committed = replay_journal(journal_data, cache);
+    lock_journal(cache->fd, F_UNLCK);
+    
+    if (checkpoint_due(journal_data, committed)) {
+        journal_data = checkpoint_exclusive(cache, journal_data);
+        lock_journal(cache->fd, F_UNLCK);
+    }
+    free(journal_data);
+}
+
+static int find_dirent(const struct dirent *dirents, const char *name) {
+    char key[sizeof(dirents[0].name)];
+    strncpy(key, name, sizeof(key) - 1);
+    key[sizeof(key) - 1] = '\0';
+    
+    uint32_t max_entries = BLOCK_SIZE / sizeof(struct dirent);
+    for (uint32_t i = 0; i < max_entries; ++i) {
+        if (dirents[i].name[0] != '\0' && strncmp(dirents[i].name, key, sizeof(key)) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Adds filename to the running transaction. Later creates in the same transaction
+ * update its working copies of the directory, bitmap and inode blocks in place,
+ * so each block is logged once however many names share it. Fills rec when given.
+ */
+static int create_entry(struct txn *txn, struct dirent *dirents, const char *filename, uint32_t now, struct create_record *rec) {
     int free_entry = -1;
     uint32_t max_entries = BLOCK_SIZE / sizeof(struct dirent);
     for (uint32_t i = 0; i < max_entries; ++i) {
@@ -243,14 +1907,35 @@ static void cmd_create(int fd, const char *filename) {
     
     if (free_entry < 0) {
         fprintf(stderr, "Root directory is full.\n");
-        free(journal_data);
-        return;
+        return -1;
     }
     
-    uint8_t inode_block[BLOCK_SIZE];
-    uint32_t inode_block_idx = free_inode / (BLOCK_SIZE / INODE_SIZE);
-    uint32_t inode_offset = (free_inode % (BLOCK_SIZE / INODE_SIZE)) * INODE_SIZE;
-    pread_block(fd, INODE_START_IDX + inode_block_idx, inode_block);
+    uint32_t slot_first = 0;
+    uint32_t slot_end = 0;
+    int group = pick_inode_slot(txn, 0, &slot_first, &slot_end);
+    uint8_t *inode_bitmap = NULL;
+    int local = -1;
+    if (group >= 0) {
+        inode_bitmap = txn_block(txn, GROUP_INODE_BMAP(group), 1);
+        local = bitmap_claim((uint64_t *)inode_bitmap, slot_first, slot_end, &inode_alloc_hint);
+    }
+    if (local < 0) {
+        fprintf(stderr, "No free inodes available.\n");
+        return -1;
+    }
+    uint32_t free_inode = (uint32_t)group * INODES_PER_GROUP + (uint32_t)local;
+    struct group_summary *summary = bitmap_summary(inode_bitmap);
+    int init_group = (summary->flags & GROUP_INODE_UNINIT) != 0;
+    summary->flags &= ~GROUP_INODE_UNINIT;
+    summary->free_count--;
+    
+    if (init_group) {
+        for (uint32_t i = 0; i < GROUP_INODE_BLOCKS; ++i) {
+            txn_block(txn, GROUP_INODE_START(group) + i, 0);
+        }
+    }
+    uint8_t *inode_block = txn_block(txn, inode_block_no(free_inode), 1);
+    uint32_t inode_offset = (free_inode % INODES_PER_BLOCK) * INODE_SIZE;
     
     struct inode new_inode_data;
     memset(&new_inode_data, 0, sizeof(new_inode_data));
@@ -258,158 +1943,789 @@ static void cmd_create(int fd, const char *filename) {
     new_inode_data.links = 1;
     new_inode_data.size = 0;
     memset(new_inode_data.direct, 0, sizeof(new_inode_data.direct));
-    time_t now = time(NULL);
-    new_inode_data.ctime = (uint32_t)now;
-    new_inode_data.mtime = (uint32_t)now;
+    new_inode_data.ctime = now;
+    new_inode_data.mtime = now;
     
     memcpy(inode_block + inode_offset, &new_inode_data, sizeof(struct inode));
     
-    if (inode_block_idx == 0) {
-        struct inode *root_inode = (struct inode *)inode_block;
-        root_inode->size = (free_entry + 1) * sizeof(struct dirent);
-        root_inode->mtime = (uint32_t)now;
+    dirents[free_entry].inode = free_inode;
+    strncpy(dirents[free_entry].name, filename, sizeof(dirents[free_entry].name) - 1);
+    dirents[free_entry].name[sizeof(dirents[free_entry].name) - 1] = '\0';
+    
+    if (rec) {
+        memset(rec, 0, sizeof(*rec));
+        rec->hdr.type = REC_CREATE;
+        rec->hdr.size = sizeof(*rec);
+        rec->ino = free_inode;
+        rec->slot = (uint16_t)free_entry;
+        rec->time = now;
+        memcpy(rec->name, dirents[free_entry].name, sizeof(rec->name));
     }
+    return 0;
+}
+
+/* Creates every name in one transaction, stopping at the first that does not fit. */
+static void cmd_create(struct block_cache *cache, char **names, int count) {
+    int fd = cache->fd;
+    lock_block(fd, DATA_START_IDX, F_WRLCK);
+    lock_inode_groups(fd, F_WRLCK);
+    sync_with_journal(cache);
     
-    bitmap_set(inode_bitmap, free_inode);
+    struct txn txn;
+    txn_begin(&txn, cache);
+    struct dirent *dirents = (struct dirent *)txn_block(&txn, DATA_START_IDX, 1);
+    uint32_t now = (uint32_t)time(NULL);
     
-    dirents[free_entry].inode = (uint32_t)free_inode;
-    strncpy(dirents[free_entry].name, filename, sizeof(dirents[free_entry].name) - 1);
-    dirents[free_entry].name[sizeof(dirents[free_entry].name) - 1] = '\0';
+    /* The blocks still update the cache; only the journal sees the operations instead. */
+    struct create_record *records = NULL;
+    if (journal_logical) {
+        records = malloc((size_t)count * sizeof(*records));
+        if (!records) {
+            die("malloc create records");
+        }
+    }
     
-    if (append_data_record(journal_data, INODE_BMAP_IDX, inode_bitmap) < 0) {
-        free(journal_data);
-        return;
+    /* Log the parent's inode block first so the allocator can place new inodes beside it. */
+    if (!lazytime) {
+        txn_block(&txn, inode_block_no(0), 1);
+    }
+    int created = 0;
+    while (created < count && create_entry(&txn, dirents, names[created], now, records ? &records[created] : NULL) == 0) {
+        created++;
     }
     
-    if (append_data_record(journal_data, INODE_START_IDX + inode_block_idx, inode_block) < 0) {
-        free(journal_data);
-        return;
+    if (created > 0) {
+        if (txn_logs_block(&txn, inode_block_no(0))) {
+            struct inode *root_inode = (struct inode *)txn_block(&txn, inode_block_no(0), 1);
+            root_inode->size = dir_size(dirents);
+            root_inode->mtime = now;
+        }
+        txn.logical = records;
+        txn.nlogical = (uint32_t)created;
+        commit_transaction(&txn);
+    }
+    free(records);
+    txn_end(&txn);
+    lock_image(fd, F_UNLCK);
+}
+
+static void free_inode_blocks(struct txn *txn, const struct inode *inode) {
+    for (uint32_t d = 0; d < DIRECT_POINTERS; ++d) {
+        uint32_t blk = inode->direct[d];
+        if (blk < GROUP_START_IDX || blk >= TOTAL_BLOCKS) {
+            continue;
+        }
+        uint32_t group = (blk - GROUP_START_IDX) / GROUP_BLOCKS;
+        if (blk < GROUP_DATA_START(group)) {
+            continue;
+        }
+        txn_defer_free(txn, GROUP_DATA_BMAP(group), blk - GROUP_DATA_START(group));
+        txn_revoke(txn, blk);
     }
+}
+
+static void cmd_unlink(struct block_cache *cache, char **names, int count) {
+    int fd = cache->fd;
+    lock_block(fd, DATA_START_IDX, F_WRLCK);
+    lock_inode_groups(fd, F_WRLCK);
+    lock_data_bitmaps(fd, F_WRLCK);
+    sync_with_journal(cache);
+    
+    struct txn txn;
+    txn_begin(&txn, cache);
+    struct dirent *dirents = (struct dirent *)txn_block(&txn, DATA_START_IDX, 1);
+    int removed = 0;
     
-    if (inode_block_idx != 0) {
-        uint8_t root_inode_block[BLOCK_SIZE];
-        pread_block(fd, INODE_START_IDX, root_inode_block);
-        struct inode *root_inode = (struct inode *)root_inode_block;
-        root_inode->size = (free_entry + 1) * sizeof(struct dirent);
-        root_inode->mtime = (uint32_t)now;
+    for (int n = 0; n < count; ++n) {
+        if (strcmp(names[n], ".") == 0 || strcmp(names[n], "..") == 0) {
+            fprintf(stderr, "Cannot unlink '%s'.\n", names[n]);
+            continue;
+        }
+        int entry = find_dirent(dirents, names[n]);
+        if (entry < 0) {
+            fprintf(stderr, "No such file '%s'.\n", names[n]);
+            continue;
+        }
         
-        if (append_data_record(journal_data, INODE_START_IDX, root_inode_block) < 0) {
-            free(journal_data);
-            return;
+        uint32_t ino = dirents[entry].inode;
+        memset(&dirents[entry], 0, sizeof(dirents[entry]));
+        removed++;
+        
+        uint8_t *inode_block = txn_block(&txn, inode_block_no(ino), 1);
+        struct inode *inode = (struct inode *)(inode_block + (ino % INODES_PER_BLOCK) * INODE_SIZE);
+        if (inode->links > 0) {
+            inode->links--;
+        }
+        if (inode->links > 0) {
+            continue;
+        }
+        free_inode_blocks(&txn, inode);
+        memset(inode, 0, sizeof(*inode));
+        txn_defer_free(&txn, GROUP_INODE_BMAP(ino / INODES_PER_GROUP), ino % INODES_PER_GROUP);
+    }
+    
+    if (removed > 0) {
+        struct inode *root_inode = (struct inode *)txn_block(&txn, INODE_START_IDX, 1);
+        root_inode->size = dir_size(dirents);
+        root_inode->mtime = (uint32_t)time(NULL);
+        commit_transaction(&txn);
+    }
+    txn_end(&txn);
+    lock_image(fd, F_UNLCK);
+}
+
+/* Reads up to cap bytes of path into buf; a file longer than cap reports cap + 1. */
+static int read_host_file(const char *path, uint8_t *buf, uint32_t cap, uint32_t *len) {
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        perror(path);
+        return -1;
+    }
+    size_t got = fread(buf, 1, cap, in);
+    if (got == cap && fgetc(in) != EOF) {
+        got = (size_t)cap + 1;
+    }
+    int failed = ferror(in);
+    fclose(in);
+    if (failed) {
+        fprintf(stderr, "Failed to read '%s'.\n", path);
+        return -1;
+    }
+    *len = (uint32_t)got;
+    return 0;
+}
+
+/* Claims a free data block, trying group first; returns 0 when every group is full. */
+static uint32_t alloc_data_block(struct txn *txn, uint32_t group) {
+    uint8_t scratch[BLOCK_SIZE];
+    for (uint32_t n = 0; n < GROUP_COUNT; ++n) {
+        uint32_t g = (group + n) % GROUP_COUNT;
+        const uint8_t *peek = txn_peek(txn, GROUP_DATA_BMAP(g), scratch);
+        if (((const struct group_summary *)(peek + SUMMARY_OFFSET))->free_count == 0) {
+            continue;
+        }
+        uint8_t *bitmap = txn_block(txn, GROUP_DATA_BMAP(g), 1);
+        int local = bitmap_claim((uint64_t *)bitmap, 0, GROUP_DATA_BLOCKS, &data_alloc_hint);
+        if (local >= 0) {
+            bitmap_summary(bitmap)->free_count--;
+            return GROUP_DATA_START(g) + (uint32_t)local;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Replaces the contents of name with len bytes of data. Files that fit in the
+ * inode are stored inline, so the write logs only the inode block. Larger files
+ * always get freshly allocated blocks and the old ones are freed at commit, so
+ * in ordered mode the in-place data writes never touch blocks that the
+ * committed inode still points at, and a crash before the commit leaves them
+ * free. They are flushed before the commit is logged, so it cannot reach disk
+ * ahead of them.
+ */
+static int write_file(struct block_cache *cache, const char *name, const uint8_t *data, uint32_t len) {
+    int fd = cache->fd;
+    lock_block(fd, DATA_START_IDX, F_WRLCK);
+    lock_inode_groups(fd, F_WRLCK);
+    lock_data_bitmaps(fd, F_WRLCK);
+    sync_with_journal(cache);
+    
+    uint8_t dir_block[BLOCK_SIZE];
+    cache_read_block(cache, DATA_START_IDX, dir_block);
+    const struct dirent *dirents = (const struct dirent *)dir_block;
+    int entry = find_dirent(dirents, name);
+    if (entry < 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        fprintf(stderr, "No such file '%s'.\n", name);
+        lock_image(fd, F_UNLCK);
+        return -1;
+    }
+    
+    uint32_t ino = dirents[entry].inode;
+    struct txn txn;
+    txn_begin(&txn, cache);
+    uint8_t *inode_block = txn_block(&txn, inode_block_no(ino), 1);
+    struct inode *inode = (struct inode *)(inode_block + (ino % INODES_PER_BLOCK) * INODE_SIZE);
+    if (inode->type != 1) {
+        fprintf(stderr, "'%s' is not a regular file.\n", name);
+        txn_end(&txn);
+        lock_image(fd, F_UNLCK);
+        return -1;
+    }
+    
+    free_inode_blocks(&txn, inode);
+    memset(inode->direct, 0, sizeof(inode->direct));
+    memset(inode->inline_data, 0, sizeof(inode->inline_data));
+    if (len <= INLINE_DATA_MAX) {
+        inode->flags |= INODE_INLINE;
+        memcpy(inode->inline_data, data, len);
+    }
+    else {
+        inode->flags &= ~INODE_INLINE;
+    }
+    
+    uint32_t nblocks = len <= INLINE_DATA_MAX ? 0 : (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (uint32_t i = 0; i < nblocks; ++i) {
+        inode->direct[i] = alloc_data_block(&txn, ino / INODES_PER_GROUP);
+        if (inode->direct[i] == 0) {
+            fprintf(stderr, "No free data blocks available.\n");
+            txn_end(&txn);
+            lock_image(fd, F_UNLCK);
+            return -1;
+        }
+    }
+    
+    uint8_t *block = nblocks > 0 && !data_journal ? alloc_blocks(BLOCK_SIZE) : NULL;
+    for (uint32_t i = 0; i < nblocks; ++i) {
+        uint32_t offset = i * BLOCK_SIZE;
+        uint32_t chunk = len - offset < BLOCK_SIZE ? len - offset : BLOCK_SIZE;
+        if (data_journal) {
+            memcpy(txn_block(&txn, inode->direct[i], 0), data + offset, chunk);
+            continue;
+        }
+        memset(block, 0, BLOCK_SIZE);
+        memcpy(block, data + offset, chunk);
+        cache_discard(cache, inode->direct[i]);
+        bdev_write(cache->dev, inode->direct[i], block);
+    }
+    if (block) {
+        bdev_flush(cache->dev);
+    }
+    free(block);
+    
+    inode->size = len;
+    inode->mtime = (uint32_t)time(NULL);
+    int rc = commit_transaction(&txn);
+    txn_end(&txn);
+    lock_image(fd, F_UNLCK);
+    return rc;
+}
+
+static void cmd_write(struct block_cache *cache, const char *name, const char *host_path) {
+    uint8_t *data = alloc_blocks(FILE_MAX_BYTES + 1);
+    uint32_t len = 0;
+    if (read_host_file(host_path, data, FILE_MAX_BYTES, &len) == 0) {
+        if (len > FILE_MAX_BYTES) {
+            fprintf(stderr, "'%s' is larger than the %u bytes direct pointers cover.\n", host_path, FILE_MAX_BYTES);
+        }
+        else {
+            write_file(cache, name, data, len);
+        }
+    }
+    free(data);
+}
+
+/*
+ * Rewrites a scratch file count times with len bytes in each data mode and
+ * reports the throughput and the journal traffic. Each mode starts from an
+ * installed journal, and the contents are random so compression cannot hide
+ * the cost of logging them.
+ */
+static void cmd_bench(struct block_cache *cache, uint32_t len, uint32_t count) {
+    static const char *const mode_names[] = { "ordered", "journal" };
+    char name[] = "bench.dat";
+    
+    uint8_t *data = alloc_blocks(FILE_MAX_BYTES);
+    uint32_t seed = 0x9e3779b9U;
+    for (uint32_t i = 0; i < len; ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        data[i] = (uint8_t)seed;
+    }
+    
+    uint8_t dir_block[BLOCK_SIZE];
+    lock_block(cache->fd, DATA_START_IDX, F_RDLCK);
+    sync_with_journal(cache);
+    lock_image(cache->fd, F_UNLCK);
+    cache_read_block(cache, DATA_START_IDX, dir_block);
+    int created = find_dirent((const struct dirent *)dir_block, name) < 0;
+    if (created) {
+        char *names[] = { name };
+        cmd_create(cache, names, 1);
+    }
+    
+    uint32_t saved_mode = data_journal;
+    printf("%-8s %6s %8s %10s %10s %14s\n", "mode", "bytes", "writes", "ms", "MB/s", "journal_bytes");
+    for (uint32_t mode = 0; mode < 2; ++mode) {
+        data_journal = mode;
+        free(checkpoint_exclusive(cache, NULL));
+        lock_image(cache->fd, F_UNLCK);
+        uint64_t logged = journal_bytes_logged;
+        uint32_t done = 0;
+        uint64_t start = lat_now();
+        while (done < count && write_file(cache, name, data, len) == 0) {
+            done++;
+        }
+        uint64_t elapsed = lat_now() - start;
+        printf("%-8s %6u %8u %10.3f %10.2f %14llu\n", mode_names[mode], len, done, (double)elapsed / 1e3,
+               elapsed ? (double)len * done / (double)elapsed : 0.0,
+               (unsigned long long)(journal_bytes_logged - logged));
+    }
+    data_journal = saved_mode;
+    
+    if (created) {
+        char *names[] = { name };
+        cmd_unlink(cache, names, 1);
+    }
+    free(data);
+}
+
+/*
+ * Home blocks whose newest copy in a committed transaction past the checkpoint
+ * TID outlives every revoke of it, i.e. what install would write back. The
+ * root inode rides along with the directory block for its folded size and mtime.
+ */
+static uint32_t live_home_blocks(const uint8_t *journal_data, uint32_t *blocks) {
+    const struct journal_header *jhdr = (const struct journal_header *)journal_data;
+    int last_logged[TOTAL_BLOCKS];
+    int revoked_until[TOTAL_BLOCKS];
+    uint32_t offset = sizeof(struct journal_header);
+    uint32_t txn_start = offset;
+    int ordinal = 0;
+    
+    for (uint32_t b = 0; b < TOTAL_BLOCKS; ++b) {
+        last_logged[b] = -1;
+        revoked_until[b] = -1;
+    }
+    while (offset < jhdr->nbytes_used) {
+        uint32_t span = record_span(journal_data, offset, jhdr->nbytes_used);
+        if (span == 0) {
+            break;
+        }
+        const struct rec_header *rec_hdr = (const struct rec_header *)(journal_data + offset);
+        offset += span;
+        if (rec_hdr->type != REC_COMMIT) {
+            continue;
+        }
+        if (((const struct commit_record *)rec_hdr)->tid <= jhdr->checkpoint_tid) {
+            txn_start = offset;
+            continue;
+        }
+        
+        for (uint32_t at = txn_start; at < offset; at += record_length((const struct rec_header *)(journal_data + at))) {
+            const struct rec_header *rec = (const struct rec_header *)(journal_data + at);
+            for (uint32_t i = 0; i < record_blocks(rec); ++i) {
+                uint32_t block_no = record_block_no(rec, i);
+                if (block_no < TOTAL_BLOCKS) {
+                    last_logged[block_no] = ordinal;
+                }
+            }
+            if (rec->type == REC_CREATE) {
+                uint32_t touched[GROUP_INODE_BLOCKS + 3];
+                uint32_t n = create_record_blocks((const struct create_record *)rec, touched);
+                for (uint32_t i = 0; i < n; ++i) {
+                    last_logged[touched[i]] = ordinal;
+                }
+            }
+            if (rec->type == REC_REVOKE) {
+                const struct revoke_record *revoke = (const struct revoke_record *)rec;
+                for (uint32_t i = 0; i < revoke->count; ++i) {
+                    uint32_t block_no;
+                    memcpy(&block_no, journal_data + at + sizeof(*revoke) + i * sizeof(uint32_t), sizeof(block_no));
+                    if (block_no < TOTAL_BLOCKS) {
+                        revoked_until[block_no] = ordinal;
+                    }
+                }
+            }
+        }
+        ordinal++;
+        txn_start = offset;
+    }
+    
+    if (last_logged[DATA_START_IDX] > revoked_until[DATA_START_IDX] && last_logged[inode_block_no(0)] < 0) {
+        last_logged[inode_block_no(0)] = last_logged[DATA_START_IDX];
+    }
+    uint32_t count = 0;
+    for (uint32_t b = 0; b < TOTAL_BLOCKS; ++b) {
+        if (last_logged[b] >= 0 && last_logged[b] > revoked_until[b]) {
+            blocks[count++] = b;
         }
     }
+    return count;
+}
+
+/*
+ * Lays out a journal whose records start at base, logging the cached image of
+ * each block in transactions of at most TXN_MAX_BLOCKS. A pad record covers
+ * [sizeof header, base). Every older TID counts as checkpointed.
+ */
+static int build_compacted(uint8_t *out, const struct journal_header *old, uint32_t base, struct block_cache *cache, const uint32_t *blocks, uint32_t nblocks) {
+    struct journal_header *jhdr = (struct journal_header *)out;
+    
+    memset(out, 0, JOURNAL_BLOCKS * BLOCK_SIZE);
+    jhdr->magic = JOURNAL_MAGIC;
+    jhdr->nbytes_used = base;
+    jhdr->last_tid = old->last_tid;
+    jhdr->checkpoint_tid = old->last_tid;
+    if (base > sizeof(*jhdr)) {
+        struct rec_header pad = { REC_PAD, (uint16_t)(base - sizeof(*jhdr)) };
+        memcpy(out + sizeof(*jhdr), &pad, sizeof(pad));
+    }
     
-    if (append_data_record(journal_data, DATA_START_IDX, root_data_block) < 0) {
+    for (uint32_t i = 0; i < nblocks; i += TXN_MAX_BLOCKS) {
+        struct txn txn;
+        txn_begin(&txn, cache);
+        for (uint32_t j = i; j < nblocks && j < i + TXN_MAX_BLOCKS; ++j) {
+            txn_block(&txn, blocks[j], 1);
+        }
+        int rc = append_transaction(out, &txn);
+        txn_end(&txn);
+        if (rc < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Rewrites the pending transactions as the newest image of each block they
+ * touch, dropping superseded copies, revoked blocks and the checkpointed
+ * prefix without writing anything home. The final layout is built first and
+ * nothing is written unless it is smaller than the current journal. Every
+ * switch is one header block write. A result that fits beside the header is
+ * written in place. Otherwise it is staged in the free space past the current
+ * records and switched to with a pad record, then moved to the front in a
+ * second switch once the old records are dead. The live blocks must all fit
+ * in the cache, which is where their images come from.
+ */
+static void cmd_compact(struct block_cache *cache) {
+    lock_image(cache->fd, F_WRLCK);
+    uint8_t *journal_data = read_journal(cache->dev);
+    struct journal_header *jhdr = (struct journal_header *)journal_data;
+    
+    if (jhdr->magic != JOURNAL_MAGIC) {
+        fprintf(stderr, "Journal is not initialized.\n");
+        free(journal_data);
+        lock_image(cache->fd, F_UNLCK);
+        return;
+    }
+    if (jhdr->nbytes_used == sizeof(struct journal_header)) {
         free(journal_data);
+        lock_image(cache->fd, F_UNLCK);
         return;
     }
     
-    if (append_commit_record(journal_data) < 0) {
+    int transaction_count = replay_journal(journal_data, cache);
+    uint32_t blocks[TOTAL_BLOCKS];
+    uint32_t nblocks = live_home_blocks(journal_data, blocks);
+    if (nblocks > cache->capacity) {
+        fprintf(stderr, "%u live blocks do not fit in the %u-block cache; run install instead.\n", nblocks, cache->capacity);
         free(journal_data);
+        lock_image(cache->fd, F_UNLCK);
         return;
     }
     
-    write_journal(fd, journal_data);
+    uint8_t *out = alloc_blocks(JOURNAL_BLOCKS * BLOCK_SIZE);
+    const struct journal_header *out_hdr = (const struct journal_header *)out;
+    int in_place = build_compacted(out, jhdr, sizeof(struct journal_header), cache, blocks, nblocks) == 0
+                   && out_hdr->nbytes_used <= BLOCK_SIZE;
+    if (!in_place && build_compacted(out, jhdr, BLOCK_SIZE, cache, blocks, nblocks) < 0) {
+        out_hdr = NULL;
+    }
+    if (!out_hdr || out_hdr->nbytes_used >= jhdr->nbytes_used) {
+        fprintf(stderr, "Compaction would not shrink the %u-byte journal; leaving it alone.\n", jhdr->nbytes_used);
+        free(out);
+        free(journal_data);
+        lock_image(cache->fd, F_UNLCK);
+        return;
+    }
+    
+    if (in_place) {
+        bdev_write(cache->dev, JOURNAL_BLOCK_IDX, out);
+    }
+    else {
+        /* The front copy ends below the current records, so it never overlaps the staged one. */
+        uint32_t stage = (jhdr->nbytes_used + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        uint8_t *staged = alloc_blocks(JOURNAL_BLOCKS * BLOCK_SIZE);
+        if (build_compacted(staged, jhdr, stage, cache, blocks, nblocks) < 0) {
+            fprintf(stderr, "No free journal space to stage the compacted copy; run install instead.\n");
+            free(staged);
+            free(out);
+            free(journal_data);
+            lock_image(cache->fd, F_UNLCK);
+            return;
+        }
+        write_journal(cache->dev, staged, stage);
+        free(staged);
+        write_journal(cache->dev, out, BLOCK_SIZE);
+    }
+    
+    printf("Compacted %d transaction(s) from %u to %u journal bytes (%u blocks).\n",
+           transaction_count, jhdr->nbytes_used, out_hdr->nbytes_used, nblocks);
+    free(out);
     free(journal_data);
+    lock_image(cache->fd, F_UNLCK);
 }
 
-static void cmd_install(int fd) {
-    uint8_t *journal_data = read_journal(fd);
+static void cmd_install(struct block_cache *cache) {
+    lock_image(cache->fd, F_WRLCK);
+    uint8_t *journal_data = read_journal(cache->dev);
     struct journal_header *jhdr = (struct journal_header *)journal_data;
     
     if (jhdr->magic != JOURNAL_MAGIC) {
         fprintf(stderr, "Journal is not initialized.\n");
         free(journal_data);
+        lock_image(cache->fd, F_UNLCK);
         return;
     }
     
     if (jhdr->nbytes_used == sizeof(struct journal_header)) {
         free(journal_data);
+        lock_image(cache->fd, F_UNLCK);
         return;
     }
     
+    int transaction_count = replay_journal(journal_data, cache);
+    checkpoint_journal(cache, journal_data);
+    free(journal_data);
+    lock_image(cache->fd, F_UNLCK);
+    
+    if (transaction_count > 0) {
+        printf("Applied %d transaction(s) from journal.\n", transaction_count);
+        printf("Journal cleared.\n");
+    }
+    
+}
+
+/* Parses the journal without applying it and reports utilization and projected install I/O. */
+static void cmd_stats(struct block_cache *cache) {
+    static const char *const type_names[] = { "unknown", "data", "commit", "revoke", "zdata", "desc", "create", "pad" };
+    
+    lock_journal(cache->fd, F_RDLCK);
+    uint8_t *journal_data = read_journal(cache->dev);
+    lock_journal(cache->fd, F_UNLCK);
+    const struct journal_header *jhdr = (const struct journal_header *)journal_data;
+    
+    if (jhdr->magic != JOURNAL_MAGIC) {
+        printf("Journal is not initialized.\n");
+        free(journal_data);
+        return;
+    }
+    
+    uint32_t rec_count[REC_PAD + 1] = { 0 };
+    uint32_t rec_bytes[REC_PAD + 1] = { 0 };
+    uint32_t last_logged[TOTAL_BLOCKS] = { 0 };
+    int revoked_until[TOTAL_BLOCKS];
     uint32_t offset = sizeof(struct journal_header);
-    int transaction_count = 0;
+    uint32_t txn_start = offset;
+    uint32_t committed_end = offset;
+    uint32_t pending = 0;
+    uint32_t checkpointed = 0;
+    uint32_t pending_bytes = 0;
+    uint32_t images = 0;
+    uint32_t raw_payload = 0;
+    int ordinal = 0;
+    
+    for (uint32_t b = 0; b < TOTAL_BLOCKS; ++b) {
+        revoked_until[b] = -1;
+    }
     
     while (offset < jhdr->nbytes_used) {
-        if (offset + sizeof(struct rec_header) > jhdr->nbytes_used) {
-            fprintf(stderr, "Incomplete record header at offset %u\n", offset);
+        uint32_t span = record_span(journal_data, offset, jhdr->nbytes_used);
+        if (span == 0) {
             break;
         }
+        const struct rec_header *rec_hdr = (const struct rec_header *)(journal_data + offset);
+        rec_count[rec_hdr->type]++;
+        rec_bytes[rec_hdr->type] += span;
+        raw_payload += record_blocks(rec_hdr) * BLOCK_SIZE;
+        offset += span;
+        if (rec_hdr->type != REC_COMMIT) {
+            continue;
+        }
         
-        struct rec_header *rec_hdr = (struct rec_header *)(journal_data + offset);
-        
-        if (rec_hdr->type == REC_DATA) {
-            if (offset + sizeof(struct rec_header) + sizeof(uint32_t) + BLOCK_SIZE > jhdr->nbytes_used) {
-                fprintf(stderr, "Incomplete data record at offset %u\n", offset);
-                break;
-            }
-            
-            uint32_t block_no;
-            memcpy(&block_no, journal_data + offset + sizeof(struct rec_header), sizeof(block_no));
-            
-            uint8_t *block_data = journal_data + offset + sizeof(struct rec_header) + sizeof(uint32_t);
-            
-            pwrite_block(fd, block_no, block_data);
-            
-            offset += rec_hdr->size;
-        }
-        else if (rec_hdr->type == REC_COMMIT) {
-            transaction_count++;
-            offset += rec_hdr->size;
+        if (((const struct commit_record *)rec_hdr)->tid <= jhdr->checkpoint_tid) {
+            checkpointed++;
         }
         else {
-            fprintf(stderr, "Unknown record type %u at offset %u\n", rec_hdr->type, offset);
-            break;
+            pending++;
+            pending_bytes += offset - txn_start;
+            for (uint32_t at = txn_start; at < offset; ) {
+                const struct rec_header *rec = (const struct rec_header *)(journal_data + at);
+                for (uint32_t i = 0; i < record_blocks(rec); ++i) {
+                    uint32_t block_no = record_block_no(rec, i);
+                    if (block_no < TOTAL_BLOCKS) {
+                        last_logged[block_no] = (uint32_t)ordinal + 1;
+                    }
+                    images++;
+                }
+                if (rec->type == REC_REVOKE) {
+                    const struct revoke_record *revoke = (const struct revoke_record *)rec;
+                    for (uint32_t i = 0; i < revoke->count; ++i) {
+                        uint32_t block_no;
+                        memcpy(&block_no, journal_data + at + sizeof(*revoke) + i * sizeof(uint32_t), sizeof(block_no));
+                        if (block_no < TOTAL_BLOCKS) {
+                            revoked_until[block_no] = ordinal;
+                        }
+                    }
+                }
+                if (rec->type == REC_CREATE) {
+                    uint32_t blocks[GROUP_INODE_BLOCKS + 3];
+                    uint32_t n = create_record_blocks((const struct create_record *)rec, blocks);
+                    for (uint32_t i = 0; i < n; ++i) {
+                        last_logged[blocks[i]] = (uint32_t)ordinal + 1;
+                    }
+                }
+                at += record_length(rec);
+            }
         }
+        ordinal++;
+        txn_start = offset;
+        committed_end = offset;
     }
     
-    jhdr->nbytes_used = sizeof(struct journal_header);
-    write_journal(fd, journal_data);
-    free(journal_data);
-    
-    if (transaction_count > 0) {
-        printf("Applied %d transaction(s) from journal.\n", transaction_count);
-        printf("Journal cleared.\n");
+    /* A block is written at install if its last logged copy outlives every revoke of it. */
+    uint32_t distinct = 0;
+    uint32_t writes = 0;
+    for (uint32_t b = 0; b < TOTAL_BLOCKS; ++b) {
+        if (last_logged[b] == 0) {
+            continue;
+        }
+        distinct++;
+        if ((int)last_logged[b] - 1 > revoked_until[b]) {
+            writes++;
+        }
+    }
+    /* The root inode block rides along with a live directory block, as in live_home_blocks. */
+    uint32_t root_inode_block = inode_block_no(0);
+    if (last_logged[DATA_START_IDX] > 0 && (int)last_logged[DATA_START_IDX] - 1 > revoked_until[DATA_START_IDX]
+        && !(last_logged[root_inode_block] > 0 && (int)last_logged[root_inode_block] - 1 > revoked_until[root_inode_block])) {
+        writes++;
     }
+    uint32_t header_writes = 0;
+    if (pending > 0) {
+        header_writes = 1 + (ckpt_policy.progress_blocks ? writes / ckpt_policy.progress_blocks : pending);
+    }
+    uint32_t capacity = JOURNAL_BLOCKS * BLOCK_SIZE;
+    uint32_t logged_bytes = rec_bytes[REC_DATA] + rec_bytes[REC_ZDATA] + rec_bytes[REC_DESC];
     
+    printf("Journal:           %u / %u bytes used (%.1f%%)\n", jhdr->nbytes_used, capacity, 100.0 * jhdr->nbytes_used / capacity);
+    printf("Transaction IDs:   last %u, checkpointed through %u\n", jhdr->last_tid, jhdr->checkpoint_tid);
+    printf("Transactions:      %u pending, %u already written back\n", pending, checkpointed);
+    printf("Uncommitted tail:  %u bytes\n", jhdr->nbytes_used - committed_end);
+    printf("Records:\n");
+    for (uint32_t t = REC_DATA; t <= REC_PAD; ++t) {
+        printf("  %-8s %6u (%u bytes)\n", type_names[t], rec_count[t], rec_bytes[t]);
+    }
+    printf("Logged blocks:     %u images of %u distinct blocks\n", images, distinct);
+    if (logged_bytes > 0) {
+        printf("Block payload:     %u bytes logged for %u raw (%.2fx compression)\n", logged_bytes, raw_payload, (double)raw_payload / logged_bytes);
+    }
+    if (pending > 0) {
+        printf("Per transaction:   %.1f bytes, %.1f blocks\n", (double)pending_bytes / pending, (double)images / pending);
+    }
+    printf("Projected install: %u block writes, %u header writes (%u bytes)\n", writes, header_writes, (writes + header_writes) * BLOCK_SIZE);
+    /* Journal bytes plus install bytes, per byte of home block actually changed. */
+    if (writes > 0) {
+        printf("Write amplification: %.2fx\n", (double)(pending_bytes + (writes + header_writes) * BLOCK_SIZE) / ((double)writes * BLOCK_SIZE));
+    }
+    free(journal_data);
 }
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <create|install> [filename]\n", argv[0]);
-        fprintf(stderr, "  create <filename>  - Create a file entry (log metadata)\n");
-        fprintf(stderr, "  install            - Apply journaled updates to disk\n");
+        fprintf(stderr, "Usage: %s <create|unlink|write|bench|install|compact|stats> [filename...]\n", argv[0]);
+        fprintf(stderr, "  create <filename...>   - Create file entries in one transaction\n");
+        fprintf(stderr, "  unlink <filename...>   - Remove file entries in one transaction\n");
+        fprintf(stderr, "  write <name> <file>    - Replace a file's contents with a host file\n");
+        fprintf(stderr, "  bench <bytes> [count]  - Compare ordered and data-journaled writes\n");
+        fprintf(stderr, "  install                - Apply journaled updates to disk\n");
+        fprintf(stderr, "  compact                - Drop superseded journal copies without installing\n");
+        fprintf(stderr, "  stats                  - Report journal usage without applying it\n");
         return EXIT_FAILURE;
     }
     
     const char *command = argv[1];
     const char *image_path = DEFAULT_IMAGE;
     
-    int fd = open(image_path, O_RDWR);
-    if (fd < 0) {
-        die("open");
-    }
+    lat_init("journal");
+    struct blockdev *dev = bdev_open(image_path, env_u32("VSFS_O_DIRECT", 0) ? BDEV_DIRECT : 0, 0);
+    
+    ckpt_policy.fill_pct = env_u32("VSFS_CKPT_FILL_PCT", CKPT_DEFAULT_FILL_PCT);
+    ckpt_policy.max_age = env_u32("VSFS_CKPT_MAX_AGE", CKPT_DEFAULT_MAX_AGE);
+    ckpt_policy.max_txns = env_u32("VSFS_CKPT_MAX_TXNS", CKPT_DEFAULT_MAX_TXNS);
+    ckpt_policy.progress_blocks = env_u32("VSFS_CKPT_PROGRESS_BLOCKS", CKPT_DEFAULT_PROGRESS);
+    writeback_threads = env_u32("VSFS_WRITEBACK_THREADS", WRITEBACK_DEFAULT_THREADS);
+    compress_level = env_u32("VSFS_JOURNAL_COMPRESS", COMPRESS_DEFAULT_LEVEL);
+    journal_aligned = env_u32("VSFS_JOURNAL_ALIGNED", (uint32_t)bdev_direct(dev));
+    lazytime = env_u32("VSFS_LAZYTIME", 0);
+    journal_logical = env_u32("VSFS_JOURNAL_LOGICAL", 0);
+    data_journal = env_u32("VSFS_DATA_JOURNAL", 0);
+    
+    struct block_cache cache;
+    cache_init(&cache, dev, env_u32("VSFS_CACHE_BLOCKS", CACHE_DEFAULT_BLOCKS));
     
     if (strcmp(command, "create") == 0) {
         if (argc < 3) {
-            fprintf(stderr, "Usage: %s create <filename>\n", argv[0]);
-            close(fd);
+            fprintf(stderr, "Usage: %s create <filename...>\n", argv[0]);
+            bdev_close(dev);
             return EXIT_FAILURE;
         }
-        const char *filename = argv[2];
-        cmd_create(fd, filename);
+        uint64_t start = lat_now();
+        cmd_create(&cache, argv + 2, argc - 2);
+        lat_record_since(lat_hist("create"), start);
+    }
+    else if (strcmp(command, "unlink") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Usage: %s unlink <filename...>\n", argv[0]);
+            bdev_close(dev);
+            return EXIT_FAILURE;
+        }
+        uint64_t start = lat_now();
+        cmd_unlink(&cache, argv + 2, argc - 2);
+        lat_record_since(lat_hist("unlink"), start);
+    }
+    else if (strcmp(command, "write") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "Usage: %s write <name> <hostfile>\n", argv[0]);
+            bdev_close(dev);
+            return EXIT_FAILURE;
+        }
+        uint64_t start = lat_now();
+        cmd_write(&cache, argv[2], argv[3]);
+        lat_record_since(lat_hist("write"), start);
+    }
+    else if (strcmp(command, "bench") == 0) {
+        uint32_t len = 0;
+        uint32_t count = 100;
+        if (argc < 3 || parse_u32(argv[2], &len) < 0 || len > FILE_MAX_BYTES
+            || (argc > 3 && (parse_u32(argv[3], &count) < 0 || count == 0))) {
+            fprintf(stderr, "Usage: %s bench <bytes up to %u> [count > 0]\n", argv[0], FILE_MAX_BYTES);
+            bdev_close(dev);
+            return EXIT_FAILURE;
+        }
+        /* The benchmark installs the journal and churns a scratch file, so keep it off real images. */
+        if (strcmp(bdev_backend(dev), "memory") != 0 && !env_u32("VSFS_BENCH_ON_IMAGE", 0)) {
+            fprintf(stderr, "bench installs the journal and rewrites %s; run it with VSFS_BDEV=memory,\n", image_path);
+            fprintf(stderr, "or set VSFS_BENCH_ON_IMAGE=1 to measure a scratch image on the %s backend.\n", bdev_backend(dev));
+            bdev_close(dev);
+            return EXIT_FAILURE;
+        }
+        cmd_bench(&cache, len, count);
     }
     else if (strcmp(command, "install") == 0) {
-        cmd_install(fd);
+        uint64_t start = lat_now();
+        cmd_install(&cache);
+        lat_record_since(lat_hist("install"), start);
+    }
+    else if (strcmp(command, "compact") == 0) {
+        uint64_t start = lat_now();
+        cmd_compact(&cache);
+        lat_record_since(lat_hist("compact"), start);
+    }
+    else if (strcmp(command, "stats") == 0) {
+        cmd_stats(&cache);
     }
     else {
         fprintf(stderr, "Unknown command '%s'\n", command);
-        fprintf(stderr, "Valid commands: create, install\n");
-        close(fd);
+        fprintf(stderr, "Valid commands: create, unlink, write, bench, install, compact, stats\n");
+        bdev_close(dev);
         return EXIT_FAILURE;
     }
     
-    close(fd);
+    cache_destroy(&cache);
+    if (bdev_close(dev) < 0) {
+        die("close");
+    }
     return EXIT_SUCCESS;
 }
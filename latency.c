@@ -0,0 +1,234 @@
+#define _POSIX_C_SOURCE 200809L
+#include "latency.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LAT_SUB_BITS   3U
+#define LAT_SUB_COUNT  (1U << LAT_SUB_BITS)
+#define LAT_MAX_SHIFT  25U
+#define LAT_BUCKETS    ((LAT_MAX_SHIFT + 2U) * LAT_SUB_COUNT)
+#define LAT_MAX_HISTS  16U
+
+enum lat_format {
+    LAT_OFF,
+    LAT_TEXT,
+    LAT_JSON,
+};
+
+struct lat_hist {
+    const char *name;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[LAT_BUCKETS];
+};
+
+static enum lat_format lat_format;
+static const char *lat_tool;
+static struct lat_hist lat_hists[LAT_MAX_HISTS];
+static unsigned lat_nhists;
+static volatile sig_atomic_t lat_dump_requested;
+
+/* Values below 2 * LAT_SUB_COUNT map to themselves; above, shift keeps LAT_SUB_BITS + 1 significant bits. */
+static unsigned lat_bucket(uint64_t usec) {
+    if (usec < 2 * LAT_SUB_COUNT) {
+        return (unsigned)usec;
+    }
+    unsigned shift = 63U - (unsigned)__builtin_clzll(usec) - LAT_SUB_BITS;
+    if (shift > LAT_MAX_SHIFT) {
+        return LAT_BUCKETS - 1;
+    }
+    return shift * LAT_SUB_COUNT + (unsigned)(usec >> shift);
+}
+
+static uint64_t lat_bucket_low(unsigned index) {
+    if (index < 2 * LAT_SUB_COUNT) {
+        return index;
+    }
+    unsigned shift = index / LAT_SUB_COUNT - 1;
+    return (uint64_t)(index % LAT_SUB_COUNT + LAT_SUB_COUNT) << shift;
+}
+
+static uint64_t lat_bucket_high(unsigned index) {
+    return index + 1 < LAT_BUCKETS ? lat_bucket_low(index + 1) - 1 : UINT64_MAX;
+}
+
+/* Highest value equivalent to the q-quantile, clamped to the observed maximum. */
+static uint64_t lat_quantile(const struct lat_hist *hist, uint64_t count, double q) {
+    uint64_t rank = (uint64_t)(q * (double)count + 0.5);
+    uint64_t seen = 0;
+    
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (unsigned i = 0; i < LAT_BUCKETS; ++i) {
+        seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= rank) {
+            uint64_t high = lat_bucket_high(i);
+            return high < hist->max ? high : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+static void lat_on_signal(int sig) {
+    (void)sig;
+    lat_dump_requested = 1;
+}
+
+static void lat_on_exit(void) {
+    lat_dump();
+}
+
+void lat_init(const char *tool) {
+    const char *format = getenv("VSFS_LATENCY");
+    
+    lat_tool = tool;
+    if (!format || *format == '\0' || strcmp(format, "0") == 0) {
+        lat_format = LAT_OFF;
+        return;
+    }
+    lat_format = strcmp(format, "json") == 0 ? LAT_JSON : LAT_TEXT;
+    
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lat_on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    atexit(lat_on_exit);
+}
+
+/* Called from the main thread only, before any worker could record into a new histogram. */
+struct lat_hist *lat_hist(const char *name) {
+    if (lat_format == LAT_OFF) {
+        return NULL;
+    }
+    for (unsigned i = 0; i < lat_nhists; ++i) {
+        if (strcmp(lat_hists[i].name, name) == 0) {
+            return &lat_hists[i];
+        }
+    }
+    if (lat_nhists == LAT_MAX_HISTS) {
+        return NULL;
+    }
+    struct lat_hist *hist = &lat_hists[lat_nhists++];
+    hist->name = name;
+    hist->min = UINT64_MAX;
+    return hist;
+}
+
+uint64_t lat_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000U + (uint64_t)ts.tv_nsec / 1000U;
+}
+
+void lat_record(struct lat_hist *hist, uint64_t usec) {
+    if (!hist) {
+        return;
+    }
+    __atomic_fetch_add(&hist->buckets[lat_bucket(usec)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, usec, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    
+    uint64_t seen = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (usec > seen && !__atomic_compare_exchange_n(&hist->max, &seen, usec, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    seen = __atomic_load_n(&hist->min, __ATOMIC_RELAXED);
+    while (usec < seen && !__atomic_compare_exchange_n(&hist->min, &seen, usec, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    
+    if (lat_dump_requested) {
+        lat_dump_requested = 0;
+        lat_dump();
+    }
+}
+
+void lat_record_since(struct lat_hist *hist, uint64_t start) {
+    if (hist) {
+        lat_record(hist, lat_now() - start);
+    }
+}
+
+static void lat_dump_text(FILE *out) {
+    for (unsigned i = 0; i < lat_nhists; ++i) {
+        const struct lat_hist *hist = &lat_hists[i];
+        uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+        if (count == 0) {
+            continue;
+        }
+        fprintf(out, "%s %-12s count=%llu min=%lluus mean=%lluus p50=%lluus p99=%lluus p999=%lluus max=%lluus\n",
+                lat_tool, hist->name, (unsigned long long)count, (unsigned long long)hist->min,
+                (unsigned long long)(hist->sum / count),
+                (unsigned long long)lat_quantile(hist, count, 0.50),
+                (unsigned long long)lat_quantile(hist, count, 0.99),
+                (unsigned long long)lat_quantile(hist, count, 0.999),
+                (unsigned long long)hist->max);
+    }
+}
+
+/* One object per dump; buckets lists [low, high, count] for every non-empty bucket. */
+static void lat_dump_json(FILE *out) {
+    const char *sep = "";
+    
+    fprintf(out, "{\"tool\":\"%s\",\"unit\":\"us\",\"histograms\":[", lat_tool);
+    for (unsigned i = 0; i < lat_nhists; ++i) {
+        const struct lat_hist *hist = &lat_hists[i];
+        uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+        if (count == 0) {
+            continue;
+        }
+        fprintf(out, "%s{\"name\":\"%s\",\"count\":%llu,\"min\":%llu,\"mean\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu,\"buckets\":[",
+                sep, hist->name, (unsigned long long)count, (unsigned long long)hist->min,
+                (unsigned long long)(hist->sum / count),
+                (unsigned long long)lat_quantile(hist, count, 0.50),
+                (unsigned long long)lat_quantile(hist, count, 0.99),
+                (unsigned long long)lat_quantile(hist, count, 0.999),
+                (unsigned long long)hist->max);
+        const char *bucket_sep = "";
+        for (unsigned b = 0; b < LAT_BUCKETS; ++b) {
+            if (hist->buckets[b] > 0) {
+                fprintf(out, "%s[%llu,%llu,%llu]", bucket_sep, (unsigned long long)lat_bucket_low(b),
+                        (unsigned long long)lat_bucket_high(b), (unsigned long long)hist->buckets[b]);
+                bucket_sep = ",";
+            }
+        }
+        fprintf(out, "]}");
+        sep = ",";
+    }
+    fprintf(out, "]}\n");
+}
+
+void lat_dump(void) {
+    if (lat_format == LAT_OFF) {
+        return;
+    }
+    
+    const char *path = getenv("VSFS_LATENCY_FILE");
+    FILE *out = stderr;
+    if (path && *path != '\0') {
+        out = fopen(path, "a");
+        if (!out) {
+            perror("fopen latency file");
+            return;
+        }
+    }
+    if (lat_format == LAT_JSON) {
+        lat_dump_json(out);
+    }
+    else {
+        lat_dump_text(out);
+    }
+    if (out != stderr) {
+        fclose(out);
+    }
+    else {
+        fflush(out);
+    }
+}
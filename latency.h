@@ -0,0 +1,36 @@
+#ifndef VSFS_LATENCY_H
+#define VSFS_LATENCY_H
+
+#include <stdint.h>
+
+/*
+ * Per-operation latency histograms shared by the VSFS tools.
+ *
+ * Values are microseconds in log-linear buckets: exact below 16us, then 8
+ * sub-buckets per power of two (at most 12.5% relative error) up to about
+ * nine minutes. Recording is lock free. Set VSFS_LATENCY=text or
+ * VSFS_LATENCY=json to dump every histogram at exit, and send SIGUSR1 to
+ * dump at the next recorded operation. VSFS_LATENCY_FILE appends the dump
+ * to a file instead of stderr.
+ */
+
+struct lat_hist;
+
+/* Reads the environment and arranges the exit/SIGUSR1 dumps; tool names the JSON report. */
+void lat_init(const char *tool);
+
+/* Returns the histogram called name, creating it on first use; NULL when disabled. */
+struct lat_hist *lat_hist(const char *name);
+
+/* Monotonic clock in microseconds. */
+uint64_t lat_now(void);
+
+/* Records now - start into hist; a NULL hist is ignored. */
+void lat_record_since(struct lat_hist *hist, uint64_t start);
+
+void lat_record(struct lat_hist *hist, uint64_t usec);
+
+/* Writes every histogram in the configured format. */
+void lat_dump(void);
+
+#endif
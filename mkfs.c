@@ -7,19 +7,34 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "blockdev.h"
+#include "latency.h"
+
 #define FS_MAGIC 0x56534653U
 
 #define BLOCK_SIZE        4096U
 #define INODE_SIZE         128U
 #define JOURNAL_BLOCK_IDX    1U
 #define JOURNAL_BLOCKS      16U
-#define INODE_BLOCKS         2U
-#define DATA_BLOCKS         64U
-#define INODE_BMAP_IDX     (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
-#define DATA_BMAP_IDX      (INODE_BMAP_IDX + 1U)
-#define INODE_START_IDX    (DATA_BMAP_IDX + 1U)
-#define DATA_START_IDX     (INODE_START_IDX + INODE_BLOCKS)
-#define TOTAL_BLOCKS       (DATA_START_IDX + DATA_BLOCKS)
+#define GROUP_COUNT          2U
+#define GROUP_INODE_BLOCKS   1U
+#define GROUP_DATA_BLOCKS   32U
+#define GROUP_BLOCKS       (2U + GROUP_INODE_BLOCKS + GROUP_DATA_BLOCKS)
+#define GROUP_START_IDX    (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
+#define GROUP_INODE_BMAP(g)  (GROUP_START_IDX + (g) * GROUP_BLOCKS)
+#define GROUP_DATA_BMAP(g)   (GROUP_INODE_BMAP(g) + 1U)
+#define GROUP_INODE_START(g) (GROUP_INODE_BMAP(g) + 2U)
+#define GROUP_DATA_START(g)  (GROUP_INODE_START(g) + GROUP_INODE_BLOCKS)
+#define INODE_BLOCKS       (GROUP_COUNT * GROUP_INODE_BLOCKS)
+#define DATA_BLOCKS        (GROUP_COUNT * GROUP_DATA_BLOCKS)
+#define INODE_BMAP_IDX     GROUP_INODE_BMAP(0U)
+#define DATA_BMAP_IDX      GROUP_DATA_BMAP(0U)
+#define INODE_START_IDX    GROUP_INODE_START(0U)
+#define DATA_START_IDX     GROUP_DATA_START(0U)
+#define TOTAL_BLOCKS       (GROUP_START_IDX + GROUP_COUNT * GROUP_BLOCKS)
+#define INODES_PER_GROUP   (GROUP_INODE_BLOCKS * (BLOCK_SIZE / INODE_SIZE))
+#define GROUP_INODE_UNINIT 0x1U
+#define INLINE_DATA_MAX    (INODE_SIZE - (2 + 2 + 4 + 8 * 4 + 4 + 4 + 4))
 #define DEFAULT_IMAGE "vsfs.img"
 
 struct superblock {
@@ -34,7 +49,10 @@ struct superblock {
     uint32_t inode_start;
     uint32_t data_start;
 
-    uint8_t  _pad[128 - 9 * 4];
+    uint32_t group_count;
+    uint32_t group_blocks;
+
+    uint8_t  _pad[128 - 11 * 4];
 };
 
 struct inode {
@@ -47,7 +65,8 @@ struct inode {
     uint32_t ctime;
     uint32_t mtime;
 
-    uint8_t _pad[128 - (2 + 2 + 4 + 8 * 4 + 4 + 4)];
+    uint32_t flags;
+    uint8_t inline_data[INLINE_DATA_MAX];
 };
 
 struct dirent {
@@ -55,33 +74,53 @@ struct dirent {
     char name[28];
 };
 
+/* Trailer at the end of every group bitmap block. */
+struct group_summary {
+    uint32_t free_count;
+    uint32_t flags;
+};
+
+#define SUMMARY_OFFSET (BLOCK_SIZE - sizeof(struct group_summary))
+
 _Static_assert(sizeof(struct superblock) == 128, "superblock must be 128 bytes");
 _Static_assert(sizeof(struct inode) == 128, "inode must be 128 bytes");
 _Static_assert(sizeof(struct dirent) == 32, "dirent must be 32 bytes");
+_Static_assert(INODES_PER_GROUP <= SUMMARY_OFFSET * 8, "inode bitmap overlaps its summary");
+_Static_assert(GROUP_DATA_BLOCKS <= SUMMARY_OFFSET * 8, "data bitmap overlaps its summary");
 
 static void die(const char *msg) {
     perror(msg);
     exit(EXIT_FAILURE);
 }
 
-static void write_block(int fd, const void *block) {
-    ssize_t written = write(fd, block, BLOCK_SIZE);
-    if (written != (ssize_t)BLOCK_SIZE) {
-        die("write");
-    }
+/* Blocks are laid down in order; next_block is the one the next write lands on. */
+static uint32_t next_block;
+
+static void write_block(struct blockdev *dev, const void *block) {
+    bdev_write(dev, next_block++, block);
+}
+
+/* The image is created zero-filled, so a skipped block stays a hole. */
+static void skip_block(void) {
+    next_block++;
 }
 
 static void set_bitmap(uint8_t *bitmap, uint32_t index) {
     bitmap[index / 8] |= (uint8_t)(1U << (index % 8));
 }
 
+static void set_summary(uint8_t *bitmap, uint32_t free_count, uint32_t flags) {
+    struct group_summary summary = { .free_count = free_count, .flags = flags };
+    memcpy(bitmap + SUMMARY_OFFSET, &summary, sizeof(summary));
+}
+
 int main(int argc, char *argv[]) {
     const char *image_path = (argc > 1) ? argv[1] : DEFAULT_IMAGE;
 
-    int fd = open(image_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-    if (fd < 0) {
-        die("open");
-    }
+    lat_init("mkfs");
+    uint64_t start = lat_now();
+
+    struct blockdev *dev = bdev_open(image_path, BDEV_CREATE, TOTAL_BLOCKS);
 
     uint8_t block[BLOCK_SIZE];
     memset(block, 0, sizeof(block));
@@ -96,60 +135,86 @@ int main(int argc, char *argv[]) {
         .data_bitmap = DATA_BMAP_IDX,
         .inode_start = INODE_START_IDX,
         .data_start = DATA_START_IDX,
+        .group_count = GROUP_COUNT,
+        .group_blocks = GROUP_BLOCKS,
     };
 
     memcpy(block, &sb, sizeof(sb));
-    write_block(fd, block); // Superblock
+    write_block(dev, block); // Superblock
 
     memset(block, 0, sizeof(block));
     for (uint32_t i = 0; i < JOURNAL_BLOCKS; ++i) {
-        write_block(fd, block); // Journal blocks
+        write_block(dev, block); // Journal blocks
     }
 
-    memset(block, 0, sizeof(block));
-    set_bitmap(block, 0); // Reserve inode 0 for root
-    write_block(fd, block); // Inode bitmap
-
-    memset(block, 0, sizeof(block));
-    set_bitmap(block, 0); // Reserve first data block for root directory
-    write_block(fd, block); // Data bitmap
-
     time_t now = time(NULL);
 
-    struct inode root = {0};
-    root.type = 2; // directory
-    root.links = 2; // "." and ".."
-    root.size = 2 * sizeof(struct dirent);
-    memset(root.direct, 0, sizeof(root.direct));
-    root.direct[0] = DATA_START_IDX;
-    root.ctime = (uint32_t)now;
-    root.mtime = (uint32_t)now;
-
-    memset(block, 0, sizeof(block));
-    memcpy(block, &root, sizeof(root));
-    write_block(fd, block); // First inode block
-
-    memset(block, 0, sizeof(block));
-    write_block(fd, block); // Second inode block
-
-    memset(block, 0, sizeof(block));
-    struct dirent *root_dirents = (struct dirent *)block;
-    root_dirents[0].inode = 0;
-    strncpy(root_dirents[0].name, ".", sizeof(root_dirents[0].name) - 1);
-    root_dirents[0].name[sizeof(root_dirents[0].name) - 1] = '\0';
-    root_dirents[1].inode = 0;
-    strncpy(root_dirents[1].name, "..", sizeof(root_dirents[1].name) - 1);
-    root_dirents[1].name[sizeof(root_dirents[1].name) - 1] = '\0';
-    write_block(fd, block); // First data block holds root directory entries
-
-    memset(block, 0, sizeof(block));
-    for (uint32_t i = 1; i < DATA_BLOCKS; ++i) {
-        write_block(fd, block);
+    for (uint32_t g = 0; g < GROUP_COUNT; ++g) {
+        memset(block, 0, sizeof(block));
+        if (g == 0) {
+            set_bitmap(block, 0); // Reserve inode 0 for root
+            set_summary(block, INODES_PER_GROUP - 1, 0);
+        } else {
+            set_summary(block, INODES_PER_GROUP, GROUP_INODE_UNINIT);
+        }
+        write_block(dev, block); // Group inode bitmap
+
+        memset(block, 0, sizeof(block));
+        if (g == 0) {
+            set_bitmap(block, 0); // Reserve first data block for root directory
+            set_summary(block, GROUP_DATA_BLOCKS - 1, 0);
+        } else {
+            set_summary(block, GROUP_DATA_BLOCKS, 0);
+        }
+        write_block(dev, block); // Group data bitmap
+
+        if (g == 0) {
+            struct inode root = {0};
+            root.type = 2; // directory
+            root.links = 2; // "." and ".."
+            root.size = 2 * sizeof(struct dirent);
+            memset(root.direct, 0, sizeof(root.direct));
+            root.direct[0] = DATA_START_IDX;
+            root.ctime = (uint32_t)now;
+            root.mtime = (uint32_t)now;
+
+            memset(block, 0, sizeof(block));
+            memcpy(block, &root, sizeof(root));
+            write_block(dev, block); // First inode block
+            for (uint32_t i = 1; i < GROUP_INODE_BLOCKS; ++i) {
+                memset(block, 0, sizeof(block));
+                write_block(dev, block);
+            }
+        } else {
+            for (uint32_t i = 0; i < GROUP_INODE_BLOCKS; ++i) {
+                skip_block(); // Uninitialized inode tables are left as holes
+            }
+        }
+
+        uint32_t first_free = 0;
+        if (g == 0) {
+            memset(block, 0, sizeof(block));
+            struct dirent *root_dirents = (struct dirent *)block;
+            root_dirents[0].inode = 0;
+            strncpy(root_dirents[0].name, ".", sizeof(root_dirents[0].name) - 1);
+            root_dirents[0].name[sizeof(root_dirents[0].name) - 1] = '\0';
+            root_dirents[1].inode = 0;
+            strncpy(root_dirents[1].name, "..", sizeof(root_dirents[1].name) - 1);
+            root_dirents[1].name[sizeof(root_dirents[1].name) - 1] = '\0';
+            write_block(dev, block); // First data block holds root directory entries
+            first_free = 1;
+        }
+
+        memset(block, 0, sizeof(block));
+        for (uint32_t i = first_free; i < GROUP_DATA_BLOCKS; ++i) {
+            write_block(dev, block);
+        }
     }
 
-    if (close(fd) < 0) {
+    if (bdev_close(dev) < 0) {
         die("close");
     }
+    lat_record_since(lat_hist("mkfs"), start);
 
     printf("Created VSFS image '%s' (%u blocks).\n", image_path, TOTAL_BLOCKS);
     return 0;
@@ -0,0 +1,32 @@
+#ifndef VSFS_PROBES_H
+#define VSFS_PROBES_H
+
+/*
+ * USDT tracepoints under the "vsfs" provider. With <sys/sdt.h> (systemtap-sdt-dev)
+ * each probe compiles to a single nop plus an ELF note, so it costs nothing
+ * until bpftrace or perf attaches, e.g.
+ *
+ *   bpftrace -e 'usdt:./journal:vsfs:block__write { @[arg0] = count(); }'
+ *
+ * Without the header, or with -DVSFS_NO_SDT, the probes compile away and their
+ * arguments are not evaluated.
+ */
+
+#if defined(__has_include) && !defined(VSFS_NO_SDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define VSFS_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef VSFS_HAVE_SDT
+#define VSFS_PROBE1(name, a) DTRACE_PROBE1(vsfs, name, a)
+#define VSFS_PROBE2(name, a, b) DTRACE_PROBE2(vsfs, name, a, b)
+#define VSFS_PROBE3(name, a, b, c) DTRACE_PROBE3(vsfs, name, a, b, c)
+#else
+#define VSFS_PROBE1(name, a) ((void)sizeof(a))
+#define VSFS_PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define VSFS_PROBE3(name, a, b, c) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#endif
+
+#endif
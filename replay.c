@@ -0,0 +1,313 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blockdev.h"
+#include "latency.h"
+
+#define HOT_BLOCKS 8U
+
+struct trace {
+    struct bdev_trace_record *records;
+    size_t count;
+};
+
+struct tool_stats {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t sequential;
+    uint64_t busy_ns;
+    uint32_t distinct;
+};
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+/* Parses a plain decimal uint32; rejects signs, spaces, trailing text and overflow. */
+static int parse_u32(const char *value, uint32_t *out) {
+    if (*value < '0' || *value > '9') {
+        return -1;
+    }
+    char *end;
+    errno = 0;
+    unsigned long parsed = strtoul(value, &end, 10);
+    if (*end != '\0' || errno == ERANGE || parsed > UINT32_MAX) {
+        return -1;
+    }
+    *out = (uint32_t)parsed;
+    return 0;
+}
+
+static uint32_t env_u32(const char *name, uint32_t fallback) {
+    const char *value = getenv(name);
+    if (!value || *value == '\0') {
+        return fallback;
+    }
+    uint32_t parsed;
+    if (parse_u32(value, &parsed) < 0) {
+        fprintf(stderr, "Ignoring invalid %s='%s'\n", name, value);
+        return fallback;
+    }
+    return parsed;
+}
+
+static int compare_records(const void *a, const void *b) {
+    const struct bdev_trace_record *ra = a;
+    const struct bdev_trace_record *rb = b;
+    if (ra->time_ns != rb->time_ns) {
+        return ra->time_ns < rb->time_ns ? -1 : 1;
+    }
+    return (ra->pid > rb->pid) - (ra->pid < rb->pid);
+}
+
+/* Concurrent processes flush their buffers out of order, so records are sorted by issue time. */
+static void load_trace(const char *path, struct trace *trace) {
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        die("open trace");
+    }
+
+    struct bdev_trace_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != BDEV_TRACE_MAGIC) {
+        fprintf(stderr, "'%s' is not a VSFS block trace.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (hdr.version != BDEV_TRACE_VERSION) {
+        fprintf(stderr, "Unsupported trace version %u (expected %u).\n", hdr.version, BDEV_TRACE_VERSION);
+        exit(EXIT_FAILURE);
+    }
+    if (fseek(in, 0, SEEK_END) < 0) {
+        die("seek trace");
+    }
+    long end = ftell(in);
+    if (end < 0 || fseek(in, (long)sizeof(hdr), SEEK_SET) < 0) {
+        die("seek trace");
+    }
+
+    size_t bytes = (size_t)end - sizeof(hdr);
+    trace->count = bytes / sizeof(struct bdev_trace_record);
+    if (bytes % sizeof(struct bdev_trace_record) != 0) {
+        fprintf(stderr, "Ignoring a truncated record at the end of '%s'.\n", path);
+    }
+    trace->records = malloc(trace->count ? trace->count * sizeof(struct bdev_trace_record) : 1);
+    if (!trace->records) {
+        die("malloc trace");
+    }
+    if (fread(trace->records, sizeof(struct bdev_trace_record), trace->count, in) != trace->count) {
+        die("read trace");
+    }
+    fclose(in);
+    qsort(trace->records, trace->count, sizeof(struct bdev_trace_record), compare_records);
+}
+
+static const char *op_name(uint8_t op) {
+    switch (op) {
+        case BDEV_TRACE_READ:
+            return "read";
+        case BDEV_TRACE_WRITE:
+            return "write";
+        default:
+            return "?";
+    }
+}
+
+static void cmd_dump(const struct trace *trace) {
+    uint64_t origin = trace->count ? trace->records[0].time_ns : 0;
+
+    printf("%14s  %-9s %7s  %-5s %8s %6s %10s\n", "time_ms", "tool", "pid", "op", "block", "bytes", "service_us");
+    for (size_t i = 0; i < trace->count; ++i) {
+        const struct bdev_trace_record *rec = &trace->records[i];
+        printf("%14.3f  %-9s %7u  %-5s %8u %6u %10.1f\n",
+               (double)(int64_t)(rec->time_ns - origin) / 1e6, bdev_trace_tool_name(rec->tool), rec->pid,
+               op_name(rec->op), rec->block, rec->size, (double)rec->duration_ns / 1e3);
+    }
+}
+
+/* A transfer is sequential when it lands on the block after the previous transfer of the same process. */
+static void cmd_stats(const struct trace *trace) {
+    struct tool_stats stats[BDEV_TRACE_TOOLS];
+    uint32_t max_block = 0;
+
+    memset(stats, 0, sizeof(stats));
+    for (size_t i = 0; i < trace->count; ++i) {
+        if (trace->records[i].block > max_block) {
+            max_block = trace->records[i].block;
+        }
+    }
+    uint64_t *touches = calloc((size_t)max_block + 1, sizeof(uint64_t));
+    uint8_t *seen = calloc(((size_t)max_block + 1) * BDEV_TRACE_TOOLS, 1);
+    if (!touches || !seen) {
+        die("calloc stats");
+    }
+
+    for (size_t i = 0; i < trace->count; ++i) {
+        const struct bdev_trace_record *rec = &trace->records[i];
+        uint8_t tool = rec->tool < BDEV_TRACE_TOOLS ? rec->tool : BDEV_TRACE_OTHER;
+        struct tool_stats *ts = &stats[tool];
+        if (rec->op == BDEV_TRACE_WRITE) {
+            ts->writes++;
+        }
+        else {
+            ts->reads++;
+        }
+        ts->busy_ns += rec->duration_ns;
+        if (i > 0 && trace->records[i - 1].pid == rec->pid && trace->records[i - 1].block + 1 == rec->block) {
+            ts->sequential++;
+        }
+        if (!seen[(size_t)rec->block * BDEV_TRACE_TOOLS + tool]) {
+            seen[(size_t)rec->block * BDEV_TRACE_TOOLS + tool] = 1;
+            ts->distinct++;
+        }
+        touches[rec->block]++;
+    }
+
+    printf("%-9s %9s %9s %9s %7s %12s\n", "tool", "reads", "writes", "blocks", "seq%", "mean_us");
+    for (uint8_t t = 0; t < BDEV_TRACE_TOOLS; ++t) {
+        const struct tool_stats *ts = &stats[t];
+        uint64_t total = ts->reads + ts->writes;
+        if (total == 0) {
+            continue;
+        }
+        printf("%-9s %9llu %9llu %9u %6.1f%% %12.1f\n", bdev_trace_tool_name(t),
+               (unsigned long long)ts->reads, (unsigned long long)ts->writes, ts->distinct,
+               100.0 * (double)ts->sequential / (double)total, (double)ts->busy_ns / 1e3 / (double)total);
+    }
+
+    printf("Hottest blocks:");
+    for (uint32_t n = 0; n < HOT_BLOCKS; ++n) {
+        uint32_t best = 0;
+        for (uint32_t b = 1; b <= max_block; ++b) {
+            if (touches[b] > touches[best]) {
+                best = b;
+            }
+        }
+        if (touches[best] == 0) {
+            break;
+        }
+        printf(" %u (%llu)", best, (unsigned long long)touches[best]);
+        touches[best] = 0;
+    }
+    printf("\n");
+
+    free(seen);
+    free(touches);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline_ns) {
+    uint64_t now = now_ns();
+    if (now >= deadline_ns) {
+        return;
+    }
+    struct timespec ts = {
+        .tv_sec = (time_t)((deadline_ns - now) / 1000000000U),
+        .tv_nsec = (long)((deadline_ns - now) % 1000000000U),
+    };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+/*
+ * Re-issues every transfer against image through the backend selected by VSFS_BDEV.
+ * Writes carry whatever the last read left in the buffer, so point it at a scratch
+ * copy or use VSFS_BDEV=memory.
+ */
+static void cmd_run(const struct trace *trace, const char *image_path) {
+    int timed = env_u32("VSFS_REPLAY_TIMED", 0) != 0;
+    struct lat_hist *read_hist = lat_hist("read");
+    struct lat_hist *write_hist = lat_hist("write");
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+
+    void *buf;
+    if (posix_memalign(&buf, BDEV_BLOCK_SIZE, BDEV_BLOCK_SIZE) != 0) {
+        errno = ENOMEM;
+        die("posix_memalign");
+    }
+    memset(buf, 0, BDEV_BLOCK_SIZE);
+
+    struct blockdev *dev = bdev_open(image_path, env_u32("VSFS_O_DIRECT", 0) ? BDEV_DIRECT : 0, 0);
+    uint64_t origin = trace->count ? trace->records[0].time_ns : 0;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < trace->count; ++i) {
+        const struct bdev_trace_record *rec = &trace->records[i];
+        if (timed) {
+            sleep_until(start + (rec->time_ns - origin));
+        }
+        uint64_t issued = lat_now();
+        if (rec->op == BDEV_TRACE_WRITE) {
+            bdev_write(dev, rec->block, buf);
+            lat_record_since(write_hist, issued);
+            writes++;
+        }
+        else {
+            bdev_read(dev, rec->block, buf);
+            lat_record_since(read_hist, issued);
+            reads++;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    const char *backend = bdev_backend(dev);
+    if (bdev_close(dev) < 0) {
+        die("close");
+    }
+    free(buf);
+
+    double seconds = (double)elapsed / 1e9;
+    printf("Replayed %llu reads and %llu writes on the %s backend in %.3f ms (%.0f IOPS).\n",
+           (unsigned long long)reads, (unsigned long long)writes, backend, seconds * 1e3,
+           seconds > 0 ? (double)(reads + writes) / seconds : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <command> <trace> [image]\n", argv[0]);
+        fprintf(stderr, "Commands:\n");
+        fprintf(stderr, "  dump <trace>           - Print every traced transfer\n");
+        fprintf(stderr, "  stats <trace>          - Summarize the access pattern per tool\n");
+        fprintf(stderr, "  run <trace> <image>    - Re-issue the transfers against an image\n");
+        return EXIT_FAILURE;
+    }
+
+    const char *command = argv[1];
+    struct trace trace;
+
+    lat_init("replay");
+    load_trace(argv[2], &trace);
+
+    if (strcmp(command, "dump") == 0) {
+        cmd_dump(&trace);
+    }
+    else if (strcmp(command, "stats") == 0) {
+        cmd_stats(&trace);
+    }
+    else if (strcmp(command, "run") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "Usage: %s run <trace> <image>\n", argv[0]);
+            free(trace.records);
+            return EXIT_FAILURE;
+        }
+        cmd_run(&trace, argv[3]);
+    }
+    else {
+        fprintf(stderr, "Unknown command '%s'\n", command);
+        fprintf(stderr, "Valid commands: dump, stats, run\n");
+        free(trace.records);
+        return EXIT_FAILURE;
+    }
+
+    free(trace.records);
+    return EXIT_SUCCESS;
+}
@@ -7,20 +7,37 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "blockdev.h"
+#include "latency.h"
+#include "probes.h"
+
 #define FS_MAGIC 0x56534653U
 
 #define BLOCK_SIZE        4096U
 #define INODE_SIZE         128U
 #define JOURNAL_BLOCK_IDX    1U
 #define JOURNAL_BLOCKS      16U
-#define INODE_BLOCKS         2U
-#define DATA_BLOCKS         64U
-#define INODE_BMAP_IDX     (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
-#define DATA_BMAP_IDX      (INODE_BMAP_IDX + 1U)
-#define INODE_START_IDX    (DATA_BMAP_IDX + 1U)
-#define DATA_START_IDX     (INODE_START_IDX + INODE_BLOCKS)
-#define TOTAL_BLOCKS       (DATA_START_IDX + DATA_BLOCKS)
+#define GROUP_COUNT          2U
+#define GROUP_INODE_BLOCKS   1U
+#define GROUP_DATA_BLOCKS   32U
+#define GROUP_BLOCKS       (2U + GROUP_INODE_BLOCKS + GROUP_DATA_BLOCKS)
+#define GROUP_START_IDX    (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
+#define GROUP_INODE_BMAP(g)  (GROUP_START_IDX + (g) * GROUP_BLOCKS)
+#define GROUP_DATA_BMAP(g)   (GROUP_INODE_BMAP(g) + 1U)
+#define GROUP_INODE_START(g) (GROUP_INODE_BMAP(g) + 2U)
+#define GROUP_DATA_START(g)  (GROUP_INODE_START(g) + GROUP_INODE_BLOCKS)
+#define INODE_BLOCKS       (GROUP_COUNT * GROUP_INODE_BLOCKS)
+#define DATA_BLOCKS        (GROUP_COUNT * GROUP_DATA_BLOCKS)
+#define INODE_BMAP_IDX     GROUP_INODE_BMAP(0U)
+#define DATA_BMAP_IDX      GROUP_DATA_BMAP(0U)
+#define INODE_START_IDX    GROUP_INODE_START(0U)
+#define DATA_START_IDX     GROUP_DATA_START(0U)
+#define TOTAL_BLOCKS       (GROUP_START_IDX + GROUP_COUNT * GROUP_BLOCKS)
+#define INODES_PER_GROUP   (GROUP_INODE_BLOCKS * (BLOCK_SIZE / INODE_SIZE))
+#define GROUP_INODE_UNINIT 0x1U
 #define DIRECT_POINTERS     8U
+#define INODE_INLINE       0x1U
+#define INLINE_DATA_MAX    (INODE_SIZE - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4 + 4))
 #define DEFAULT_IMAGE "vsfs.img"
 
 struct superblock {
@@ -35,7 +52,10 @@ struct superblock {
     uint32_t inode_start;
     uint32_t data_start;
 
-    uint8_t  _pad[128 - 9 * 4];
+    uint32_t group_count;
+    uint32_t group_blocks;
+
+    uint8_t  _pad[128 - 11 * 4];
 };
 
 struct inode {
@@ -48,7 +68,8 @@ struct inode {
     uint32_t ctime;
     uint32_t mtime;
 
-    uint8_t _pad[128 - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4)];
+    uint32_t flags;
+    uint8_t inline_data[INLINE_DATA_MAX];
 };
 
 struct dirent {
@@ -56,9 +77,19 @@ struct dirent {
     char name[28];
 };
 
+/* Trailer at the end of every group bitmap block. */
+struct group_summary {
+    uint32_t free_count;
+    uint32_t flags;
+};
+
+#define SUMMARY_OFFSET (BLOCK_SIZE - sizeof(struct group_summary))
+
 _Static_assert(sizeof(struct superblock) == 128, "superblock must be 128 bytes");
 _Static_assert(sizeof(struct inode) == 128, "inode must be 128 bytes");
 _Static_assert(sizeof(struct dirent) == 32, "dirent must be 32 bytes");
+_Static_assert(INODES_PER_GROUP <= SUMMARY_OFFSET * 8, "inode bitmap overlaps its summary");
+_Static_assert(GROUP_DATA_BLOCKS <= SUMMARY_OFFSET * 8, "data bitmap overlaps its summary");
 
 static int error_count = 0;
 
@@ -77,11 +108,15 @@ static void report_error(const char *fmt, ...) {
     error_count++;
 }
 
-static void pread_block(int fd, uint32_t block_index, void *buf) {
-    off_t offset = (off_t)block_index * BLOCK_SIZE;
-    ssize_t n = pread(fd, buf, BLOCK_SIZE, offset);
-    if (n != (ssize_t)BLOCK_SIZE) {
-        die("pread");
+static void lock_image(int fd, short type) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &fl) < 0) {
+        if (errno != EINTR) {
+            die("fcntl lock");
+        }
     }
 }
 
@@ -89,16 +124,49 @@ static int bitmap_test(const uint8_t *bitmap, uint32_t index) {
     return (bitmap[index / 8] >> (index % 8)) & 0x1;
 }
 
-static void bitmap_check_zero_tail(const uint8_t *bitmap, uint32_t valid_bits, const char *name) {
-    uint32_t total_bits = BLOCK_SIZE * 8;
+static void bitmap_check_zero_tail(const uint8_t *bitmap, uint32_t valid_bits, const char *name, uint32_t group) {
+    uint32_t total_bits = SUMMARY_OFFSET * 8;
     for (uint32_t bit = valid_bits; bit < total_bits; ++bit) {
         if (bitmap_test(bitmap, bit)) {
-            report_error("%s bitmap has stray bit set at %u", name, bit);
+            report_error("group %u %s bitmap has stray bit set at %u", group, name, bit);
             return;
         }
     }
 }
 
+static void check_summary(const uint8_t *bitmap, uint32_t valid_bits, uint32_t allowed_flags,
+                          const char *name, uint32_t group) {
+    struct group_summary summary;
+    memcpy(&summary, bitmap + SUMMARY_OFFSET, sizeof(summary));
+
+    uint32_t free_bits = 0;
+    for (uint32_t bit = 0; bit < valid_bits; ++bit) {
+        free_bits += !bitmap_test(bitmap, bit);
+    }
+    if (summary.free_count != free_bits) {
+        report_error("group %u %s free count %u disagrees with bitmap (%u free)", group, name, summary.free_count, free_bits);
+    }
+    if (summary.flags & ~allowed_flags) {
+        report_error("group %u %s bitmap has unknown flags 0x%08x", group, name, summary.flags);
+    }
+}
+
+static int data_index(uint32_t blk) {
+    if (blk < GROUP_START_IDX || blk >= TOTAL_BLOCKS) {
+        return -1;
+    }
+    uint32_t group = (blk - GROUP_START_IDX) / GROUP_BLOCKS;
+    uint32_t offset = (blk - GROUP_START_IDX) % GROUP_BLOCKS;
+    if (offset < GROUP_DATA_START(0U) - GROUP_START_IDX) {
+        return -1;
+    }
+    return (int)(group * GROUP_DATA_BLOCKS + offset - (GROUP_DATA_START(0U) - GROUP_START_IDX));
+}
+
+static uint32_t data_block_no(uint32_t data_idx) {
+    return GROUP_DATA_START(data_idx / GROUP_DATA_BLOCKS) + data_idx % GROUP_DATA_BLOCKS;
+}
+
 static void validate_superblock(const struct superblock *sb) {
     if (sb->magic != FS_MAGIC) {
         report_error("invalid superblock magic 0x%08x", sb->magic);
@@ -128,9 +196,15 @@ static void validate_superblock(const struct superblock *sb) {
     if (sb->data_start != DATA_START_IDX) {
         report_error("data start index mismatch %u", sb->data_start);
     }
+    if (sb->group_count != GROUP_COUNT) {
+        report_error("unexpected group count %u", sb->group_count);
+    }
+    if (sb->group_blocks != GROUP_BLOCKS) {
+        report_error("unexpected blocks per group %u", sb->group_blocks);
+    }
 }
 
-static void check_directory(int fd,
+static void check_directory(struct blockdev *dev,
                             const struct inode *inode,
                             uint32_t inode_index,
                             const uint8_t *inode_used,
@@ -152,7 +226,7 @@ static void check_directory(int fd,
             report_error("inode %u directory missing data block for bytes still remaining", inode_index);
             return;
         }
-        pread_block(fd, blk, block);
+        bdev_read(dev, blk, block);
         uint32_t chunk = bytes_remaining > BLOCK_SIZE ? BLOCK_SIZE : bytes_remaining;
         uint32_t entries = chunk / sizeof(struct dirent);
         const struct dirent *entries_ptr = (const struct dirent *)block;
@@ -161,6 +235,7 @@ static void check_directory(int fd,
             if (de->inode == 0 && de->name[0] == '\0') {
                 continue;
             }
+            VSFS_PROBE3(dirent__check, inode_index, de->inode, blk);
             if (de->inode >= inode_count) {
                 report_error("inode %u directory entry points to out-of-range inode %u", inode_index, de->inode);
                 continue;
@@ -202,31 +277,77 @@ static void check_directory(int fd,
     }
 }
 
+/* Inline files keep their bytes in the inode, so they must not also own data blocks. */
+static void check_inline(const struct inode *inode, uint32_t inode_index) {
+    if (inode->type != 1) {
+        report_error("inode %u of type %u has inline data", inode_index, inode->type);
+    }
+    if (inode->size > INLINE_DATA_MAX) {
+        report_error("inode %u inline size %u exceeds %u bytes", inode_index, inode->size, INLINE_DATA_MAX);
+        return;
+    }
+    for (uint32_t d = 0; d < DIRECT_POINTERS; ++d) {
+        if (inode->direct[d] != 0) {
+            report_error("inode %u has inline data and data block %u", inode_index, inode->direct[d]);
+        }
+    }
+    for (uint32_t b = inode->size; b < INLINE_DATA_MAX; ++b) {
+        if (inode->inline_data[b] != 0) {
+            report_error("inode %u has stale inline bytes past its size", inode_index);
+            break;
+        }
+    }
+}
+
 int main(int argc, char *argv[]) {
     const char *image_path = (argc > 1) ? argv[1] : DEFAULT_IMAGE;
 
-    int fd = open(image_path, O_RDONLY);
-    if (fd < 0) {
-        die("open");
-    }
+    lat_init("validator");
+    uint64_t start = lat_now();
 
+    struct blockdev *dev = bdev_open(image_path, BDEV_RDONLY, 0);
+    lock_image(bdev_fd(dev), F_RDLCK);
+
+    uint8_t sb_block[BLOCK_SIZE];
+    bdev_read(dev, 0, sb_block);
     struct superblock sb;
-    pread_block(fd, 0, &sb);
+    memcpy(&sb, sb_block, sizeof(sb));
     validate_superblock(&sb);
 
-    uint8_t inode_bitmap[BLOCK_SIZE];
-    uint8_t data_bitmap[BLOCK_SIZE];
-    pread_block(fd, INODE_BMAP_IDX, inode_bitmap);
-    pread_block(fd, DATA_BMAP_IDX, data_bitmap);
+    uint8_t inode_bitmaps[GROUP_COUNT][BLOCK_SIZE];
+    uint8_t data_bitmaps[GROUP_COUNT][BLOCK_SIZE];
+    uint32_t inode_flags[GROUP_COUNT];
+    for (uint32_t g = 0; g < GROUP_COUNT; ++g) {
+        bdev_read(dev, GROUP_INODE_BMAP(g), inode_bitmaps[g]);
+        bdev_read(dev, GROUP_DATA_BMAP(g), data_bitmaps[g]);
+        check_summary(inode_bitmaps[g], INODES_PER_GROUP, GROUP_INODE_UNINIT, "inode", g);
+        check_summary(data_bitmaps[g], GROUP_DATA_BLOCKS, 0, "data", g);
+        bitmap_check_zero_tail(inode_bitmaps[g], INODES_PER_GROUP, "inode", g);
+        bitmap_check_zero_tail(data_bitmaps[g], GROUP_DATA_BLOCKS, "data", g);
+        struct group_summary summary;
+        memcpy(&summary, inode_bitmaps[g] + SUMMARY_OFFSET, sizeof(summary));
+        inode_flags[g] = summary.flags;
+    }
+    if (inode_flags[0] & GROUP_INODE_UNINIT) {
+        report_error("group 0 holds the root inode but is flagged uninitialized");
+    }
 
     uint32_t inode_count = sb.inode_count;
+    if (inode_count > GROUP_COUNT * INODES_PER_GROUP) {
+        inode_count = GROUP_COUNT * INODES_PER_GROUP;
+    }
     uint32_t total_inode_bytes = INODE_BLOCKS * BLOCK_SIZE;
     uint8_t *inode_area = malloc(total_inode_bytes);
     if (!inode_area) {
         die("malloc inode area");
     }
     for (uint32_t i = 0; i < INODE_BLOCKS; ++i) {
-        pread_block(fd, INODE_START_IDX + i, inode_area + (i * BLOCK_SIZE));
+        uint32_t g = i / GROUP_INODE_BLOCKS;
+        if (inode_flags[g] & GROUP_INODE_UNINIT) {
+            memset(inode_area + (i * BLOCK_SIZE), 0, BLOCK_SIZE);
+            continue;
+        }
+        bdev_read(dev, GROUP_INODE_START(g) + i % GROUP_INODE_BLOCKS, inode_area + (i * BLOCK_SIZE));
     }
     struct inode *inodes = (struct inode *)inode_area;
 
@@ -247,7 +368,7 @@ int main(int argc, char *argv[]) {
     for (uint32_t i = 0; i < inode_count; ++i) {
         struct inode *ino = &inodes[i];
         int allocated = ino->type != 0;
-        int bitmap_bit = bitmap_test(inode_bitmap, i);
+        int bitmap_bit = bitmap_test(inode_bitmaps[i / INODES_PER_GROUP], i % INODES_PER_GROUP);
         if (allocated != bitmap_bit) {
             report_error("inode %u allocation mismatch (inode vs bitmap)", i);
         }
@@ -255,10 +376,18 @@ int main(int argc, char *argv[]) {
         if (!allocated) {
             continue;
         }
+        VSFS_PROBE3(inode__check, i, ino->type, ino->size);
 
         if (ino->type > 2) {
             report_error("inode %u has invalid type %u", i, ino->type);
         }
+        if (ino->flags & ~INODE_INLINE) {
+            report_error("inode %u has unknown flags 0x%x", i, ino->flags & ~INODE_INLINE);
+        }
+        if (ino->flags & INODE_INLINE) {
+            check_inline(ino, i);
+            continue;
+        }
 
         uint32_t required_blocks = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
         if (required_blocks > DIRECT_POINTERS) {
@@ -272,11 +401,11 @@ int main(int argc, char *argv[]) {
                 continue;
             }
             seen_blocks++;
-            if (blk < DATA_START_IDX || blk >= DATA_START_IDX + DATA_BLOCKS) {
+            int data_idx = data_index(blk);
+            if (data_idx < 0) {
                 report_error("inode %u points outside data region (block %u)", i, blk);
                 continue;
             }
-            uint32_t data_idx = blk - DATA_START_IDX;
             if (data_owner[data_idx] != -1 && data_owner[data_idx] != (int)i) {
                 report_error("data block %u referenced by both inode %d and inode %u", blk, data_owner[data_idx], i);
             }
@@ -292,7 +421,7 @@ int main(int argc, char *argv[]) {
         }
 
         if (ino->type == 2) {
-            check_directory(fd, ino, i, inode_used, inode_count, link_refs);
+            check_directory(dev, ino, i, inode_used, inode_count, link_refs);
         }
     }
 
@@ -306,7 +435,7 @@ int main(int argc, char *argv[]) {
     }
 
     for (uint32_t bit = 0; bit < inode_count; ++bit) {
-        int bit_val = bitmap_test(inode_bitmap, bit);
+        int bit_val = bitmap_test(inode_bitmaps[bit / INODES_PER_GROUP], bit % INODES_PER_GROUP);
         if (bit_val && !inode_used[bit]) {
             report_error("inode bitmap marks %u used but inode is free", bit);
         }
@@ -314,23 +443,21 @@ int main(int argc, char *argv[]) {
             report_error("inode bitmap misses allocated inode %u", bit);
         }
     }
-    bitmap_check_zero_tail(inode_bitmap, inode_count, "inode");
 
     for (uint32_t bit = 0; bit < DATA_BLOCKS; ++bit) {
-        int bit_val = bitmap_test(data_bitmap, bit);
+        int bit_val = bitmap_test(data_bitmaps[bit / GROUP_DATA_BLOCKS], bit % GROUP_DATA_BLOCKS);
         if (bit_val && !data_blocks_referenced[bit]) {
-            report_error("data bitmap marks block %u used but no inode references it", bit + DATA_START_IDX);
+            report_error("data bitmap marks block %u used but no inode references it", data_block_no(bit));
         }
         if (!bit_val && data_blocks_referenced[bit]) {
-            report_error("data block %u referenced but bitmap is clear", bit + DATA_START_IDX);
+            report_error("data block %u referenced but bitmap is clear", data_block_no(bit));
         }
     }
 
-    bitmap_check_zero_tail(data_bitmap, DATA_BLOCKS, "data");
-
-    if (close(fd) < 0) {
+    if (bdev_close(dev) < 0) {
         die("close");
     }
+    lat_record_since(lat_hist("validate"), start);
 
     if (error_count == 0) {
         printf("Filesystem '%s' is consistent.\n", image_path);